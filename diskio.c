@@ -0,0 +1,102 @@
+/*
+ * diskio.c: FatFs low level disk I/O glue for ulibSD.
+ * See LICENSE.
+ *
+ * Add this file to a project that builds FatFs (ff.c) instead of the
+ * diskio.c skeleton that comes with it. Only one card (drive 0) is handled.
+ */
+
+#include "diskio.h" /* FatFs disk I/O interface */
+#include "sd_io.h"
+
+/* Device descriptor of the card behind drive 0 */
+static SD_DEV sd_dev[1];
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Translate a SD function result to a FatFs disk result.
+    \param res Result of a SD function.
+    \return FatFs disk result.
+ */
+static DRESULT __DIO_Result(SDRESULTS res)
+{
+    switch(res)
+    {
+        case SD_OK:     return(RES_OK);
+        case SD_NOINIT: return(RES_NOTRDY);
+        case SD_PARERR: return(RES_PARERR);
+        default:        return(RES_ERROR);
+    }
+}
+
+/******************************************************************************
+ Public Methods - FatFs disk I/O interface
+******************************************************************************/
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    if(pdrv) return(STA_NOINIT);
+    return((SD_Init(sd_dev) == SD_OK) ? 0 : STA_NOINIT);
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    if(pdrv) return(STA_NOINIT);
+    return(sd_dev->mount ? 0 : STA_NOINIT);
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    if(pdrv || !count) return(RES_PARERR);
+    if(!sd_dev->mount) return(RES_NOTRDY);
+    // LBA_t can be 64-bit (FF_LBA64), the card takes 32-bit sector numbers
+    if(sector > sd_dev->last_sector) return(RES_PARERR);
+    if(count == 1)
+        return(__DIO_Result(SD_Read(sd_dev, buff, sector, 0, SD_BLK_SIZE)));
+    return(__DIO_Result(SD_Read_Blocks(sd_dev, buff, sector, count)));
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    if(pdrv || !count) return(RES_PARERR);
+    if(!sd_dev->mount) return(RES_NOTRDY);
+    // LBA_t can be 64-bit (FF_LBA64), the card takes 32-bit sector numbers
+    if(sector > sd_dev->last_sector) return(RES_PARERR);
+    if(count == 1)
+        return(__DIO_Result(SD_Write(sd_dev, (void*)buff, sector)));
+    return(__DIO_Result(SD_Write_Blocks(sd_dev, buff, sector, count)));
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    LBA_t *range;
+    uint32_t sectors;
+    SDRESULTS res;
+    if(pdrv) return(RES_PARERR);
+    if(!sd_dev->mount) return(RES_NOTRDY);
+    switch(cmd)
+    {
+        // Make sure that no pending write process
+        case CTRL_SYNC:
+            return(__DIO_Result(SD_Sync(sd_dev)));
+        // Number of sectors on the card
+        case GET_SECTOR_COUNT:
+            *(LBA_t*)buff = sd_dev->last_sector + 1;
+            return(RES_OK);
+        // Erase block size in unit of sector
+        case GET_BLOCK_SIZE:
+            res = SD_Erase_Size(sd_dev, &sectors);
+            if(res == SD_OK) *(DWORD*)buff = sectors;
+            return(__DIO_Result(res));
+        // Erase a range of sectors, {start, end} (both included)
+        case CTRL_TRIM:
+            range = (LBA_t*)buff;
+            if(range[1] > sd_dev->last_sector) return(RES_PARERR);
+            return(__DIO_Result(SD_Erase(sd_dev, range[0], range[1])));
+        default:
+            return(RES_PARERR);
+    }
+}
@@ -0,0 +1,467 @@
+/*
+ * sd_bus.c: Native SD bus mode protocol engine (1 or 4-bit data bus).
+ * See LICENSE.
+ */
+
+#include "sd_bus.h"
+
+/* Response formats */
+#define SDB_RSP_NONE    0       /* No response (CMD0)                   */
+#define SDB_RSP_R1      1       /* Card status                          */
+#define SDB_RSP_R2      2       /* CID or CSD, 136 bits                 */
+#define SDB_RSP_R3      3       /* OCR, without index nor CRC           */
+#define SDB_RSP_R7      7       /* R6 and R7: index and CRC, no status  */
+
+/* Error bits of the card status of R1 */
+#define SDB_STATUS_ERR  0xFDF90008UL
+
+/* All the lines released */
+#define SDB_IDLE        (SDB_CMD|SDB_DAT)
+
+/* Incoming data packet */
+typedef struct _SDB_PKT {
+    uint8_t *dat;           /* Destination                          */
+    uint16_t cnt;           /* Bytes of the packet                  */
+    uint16_t clk;           /* Clocks received, 0 before the start  */
+    uint16_t crc[4];        /* CRC16 computed on each line          */
+    uint16_t rx[4];         /* CRC16 received on each line          */
+} SDB_PKT;
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Add a byte to a CRC7 (commands and responses).
+    \param crc CRC so far.
+    \param d Byte.
+    \return New CRC (7 bits).
+ */
+static uint8_t __SDB_Crc7(uint8_t crc, uint8_t d)
+{
+    uint8_t bit;
+    for(bit=0; bit!=8; bit++) {
+        crc <<= 1;
+        if((d ^ crc) & 0x80) crc ^= 0x09;
+        d <<= 1;
+    }
+    return(crc & 0x7F);
+}
+
+/**
+    \brief Add one clock of data to the CRC16 of each line.
+    \param crc CRC of each line.
+    \param v Levels of the lines (bit n is DATn).
+    \param lines Data lines in use.
+ */
+static void __SDB_Crc16(uint16_t *crc, uint8_t v, uint8_t lines)
+{
+    uint8_t idx;
+    for(idx=0; idx!=lines; idx++) {
+        if(((crc[idx] >> 15) ^ (v >> idx)) & 1) crc[idx] = (crc[idx] << 1) ^ 0x1021;
+        else crc[idx] <<= 1;
+    }
+}
+
+/**
+    \brief Convert a sector number to the address argument of the card.
+ */
+static inline uint32_t __SDB_Addr(SDB_DEV *dev, uint32_t sector)
+{
+    return (dev->cardtype & SDCT_BLOCK) ? sector : sector * SD_BLK_SIZE;
+}
+
+/**
+    \brief Data lines used by the bus width.
+ */
+static inline uint8_t __SDB_Mask(SDB_DEV *dev)
+{
+    return (dev->width == 4) ? SDB_DAT : SDB_DAT0;
+}
+
+/**
+    \brief Prepare the reception of a data packet.
+ */
+static void __SDB_Pkt_Init(SDB_PKT *p, void *dat, uint16_t cnt)
+{
+    uint8_t idx;
+    p->dat = (uint8_t*)dat;
+    p->cnt = cnt;
+    p->clk = 0;
+    for(idx=0; idx!=4; idx++) p->crc[idx] = p->rx[idx] = 0;
+}
+
+/**
+    \brief Take the data lines of one clock into a packet.
+    \param p Packet.
+    \param v Levels of the lines.
+    \return TRUE after the end bit.
+ */
+static uint8_t __SDB_Pkt_Step(SDB_DEV *dev, SDB_PKT *p, uint8_t v)
+{
+    uint16_t k, nd;
+    uint8_t idx;
+    v &= __SDB_Mask(dev);
+    if(!p->clk) {
+        // Start bit: the data lines go low
+        if(!v) p->clk = 1;
+        return(FALSE);
+    }
+    k = p->clk++ - 1;
+    nd = p->cnt * (8 / dev->width);
+    if(k < nd) {
+        // Data, MSB first: a nibble per clock on 4 lines, a bit on 1 line
+        __SDB_Crc16(p->crc, v, dev->width);
+        if(dev->width == 4) {
+            if(k & 1) p->dat[k >> 1] |= v;
+            else p->dat[k >> 1] = v << 4;
+        } else {
+            if(k & 7) p->dat[k >> 3] = (p->dat[k >> 3] << 1) | v;
+            else p->dat[k >> 3] = v;
+        }
+    } else if(k < nd + 16) {
+        // CRC16 of each line, MSB first
+        for(idx=0; idx!=dev->width; idx++) p->rx[idx] = (p->rx[idx] << 1) | ((v >> idx) & 1);
+    } else return(TRUE);
+    return(FALSE);
+}
+
+/**
+    \brief Check the CRC of each line of a packet received.
+    \return SD_OK, SD_ERROR on a CRC error.
+ */
+static SDRESULTS __SDB_Pkt_Check(SDB_DEV *dev, SDB_PKT *p)
+{
+    uint8_t idx;
+    for(idx=0; idx!=dev->width; idx++)
+        if(p->rx[idx] != p->crc[idx]) return(SD_ERROR);
+    return(SD_OK);
+}
+
+/**
+    \brief Wait until the card releases the busy state (DAT0 low).
+    \param ms Timeout in milliseconds.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDB_Wait_Busy(uint16_t ms)
+{
+    uint8_t v;
+    SDB_Timer_On(ms);
+    do {
+        v = SDB_Clock(SDB_IDLE) & SDB_DAT0;
+    } while(!v && (SDB_Timer_Status()==TRUE));
+    SDB_Timer_Off();
+    return(v ? SD_OK : SD_BUSY);
+}
+
+/**
+    \brief Send a command and receive its response.
+    \details The data packet of a read command can start before the end of
+    the response, so it is received in the same clocks.
+    \param cmd Command to send (ACMD«n» is sent after CMD55).
+    \param arg Argument to send.
+    \param rsp Response format (SDB_RSP_*).
+    \param r Response (6 bytes, 17 for R2), starting with the start bit.
+    \param pkt Data packet of a read command, NULL if none.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDB_Cmd(SDB_DEV *dev, uint8_t cmd, uint32_t arg, uint8_t rsp, uint8_t *r, SDB_PKT *pkt)
+{
+    SDRESULTS res;
+    uint8_t frame[6], idx, bit, len, crc, v, done;
+    uint16_t rbit, ncr;
+    uint32_t status;
+    // ACMD«n» is the command sequence of CMD55-CMD«n»
+    if(cmd & 0x80) {
+        res = __SDB_Cmd(dev, CMD55, (uint32_t)dev->rca << 16, SDB_RSP_R1, r, 0);
+        if(res != SD_OK) return(res);
+        cmd &= 0x7F;
+    }
+    // N_RC / N_CC: 8 clocks between a response and the next command
+    for(idx=0; idx!=8; idx++) SDB_Clock(SDB_IDLE);
+    // Start and transmission bits with the index, argument, CRC7 and end bit
+    frame[0] = cmd;
+    frame[1] = (uint8_t)(arg >> 24);
+    frame[2] = (uint8_t)(arg >> 16);
+    frame[3] = (uint8_t)(arg >> 8);
+    frame[4] = (uint8_t)arg;
+    crc = 0;
+    for(idx=0; idx!=5; idx++) crc = __SDB_Crc7(crc, frame[idx]);
+    frame[5] = (crc << 1) | 0x01;
+    for(idx=0; idx!=6; idx++)
+        for(bit=0; bit!=8; bit++) SDB_Clock(((frame[idx] << bit) & 0x80 ? SDB_CMD : 0) | SDB_DAT);
+    if(rsp == SDB_RSP_NONE) return(SD_OK);
+    // Response, and the data packet meanwhile
+    len = (rsp == SDB_RSP_R2) ? 17 : 6;
+    rbit = 0;
+    ncr = 0;
+    done = pkt ? FALSE : TRUE;
+    res = SD_OK;
+    if(pkt) SDB_Timer_On(SD_IO_READ_TIMEOUT_WAIT);
+    for(;;) {
+        v = SDB_Clock(SDB_IDLE);
+        if(rbit != len * 8) {
+            bit = (v & SDB_CMD) ? 1 : 0;
+            if(rbit) {
+                r[rbit >> 3] = (rbit & 7) ? (r[rbit >> 3] << 1) | bit : bit;
+                rbit++;
+            } else if(!bit) {
+                // Start bit
+                r[0] = 0;
+                rbit = 1;
+            } else if(++ncr == SDB_NCR) {
+                res = SD_NORESPONSE;
+                break;
+            }
+        }
+        if(!done) done = __SDB_Pkt_Step(dev, pkt, v);
+        if((rbit == len * 8) && done) break;
+        if((rbit == len * 8) && !pkt->clk && (SDB_Timer_Status()==FALSE)) {
+            res = SD_NORESPONSE;
+            break;
+        }
+    }
+    if(pkt) SDB_Timer_Off();
+    if(res != SD_OK) return(res);
+    // Index and CRC7 of the response
+    crc = 0;
+    switch(rsp) {
+    case SDB_RSP_R2:
+        for(idx=1; idx!=16; idx++) crc = __SDB_Crc7(crc, r[idx]);
+        if(crc != (r[16] >> 1)) return(SD_ERROR);
+        break;
+    case SDB_RSP_R3:
+        break;
+    default:
+        for(idx=0; idx!=5; idx++) crc = __SDB_Crc7(crc, r[idx]);
+        if(((r[0] & 0x3F) != (cmd & 0x3F)) || (crc != (r[5] >> 1))) return(SD_ERROR);
+    }
+    if(rsp == SDB_RSP_R1) {
+        status = ((uint32_t)r[1] << 24) | ((uint32_t)r[2] << 16) | ((uint32_t)r[3] << 8) | r[4];
+        if(status & SDB_STATUS_ERR) return(SD_ERROR);
+    }
+    return(pkt ? __SDB_Pkt_Check(dev, pkt) : SD_OK);
+}
+
+/**
+    \brief Receive a data packet that follows a previous one (CMD18).
+    \param p Packet.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDB_Rx_Data(SDB_DEV *dev, SDB_PKT *p)
+{
+    uint8_t done;
+    SDB_Timer_On(SD_IO_READ_TIMEOUT_WAIT);
+    do {
+        done = __SDB_Pkt_Step(dev, p, SDB_Clock(SDB_IDLE));
+    } while(!done && (p->clk || (SDB_Timer_Status()==TRUE)));
+    SDB_Timer_Off();
+    return(done ? __SDB_Pkt_Check(dev, p) : SD_NORESPONSE);
+}
+
+/**
+    \brief Send a data packet and wait for the end of programming.
+    \param dat Data to write (512 bytes).
+    \return If all goes well returns SD_OK, SD_REJECT if the card answers
+    with a CRC or write error.
+ */
+static SDRESULTS __SDB_Tx_Data(SDB_DEV *dev, const uint8_t *dat)
+{
+    uint16_t crc[4], idx;
+    uint8_t rel, v, k, st;
+    // Lines out of the bus width stay released
+    rel = SDB_CMD | (SDB_DAT & ~__SDB_Mask(dev));
+    for(idx=0; idx!=4; idx++) crc[idx] = 0;
+    // N_WR: two clocks before the start bit
+    SDB_Clock(SDB_IDLE);
+    SDB_Clock(SDB_IDLE);
+    SDB_Clock(rel);
+    for(idx=0; idx!=SD_BLK_SIZE; idx++) {
+        if(dev->width == 4) {
+            v = dat[idx] >> 4;
+            __SDB_Crc16(crc, v, 4);
+            SDB_Clock(rel | v);
+            v = dat[idx] & 0x0F;
+            __SDB_Crc16(crc, v, 4);
+            SDB_Clock(rel | v);
+        } else {
+            for(k=0; k!=8; k++) {
+                v = (dat[idx] >> (7 - k)) & 1;
+                __SDB_Crc16(crc, v, 1);
+                SDB_Clock(rel | v);
+            }
+        }
+    }
+    // CRC16 of each line and end bit
+    for(k=0; k!=16; k++) {
+        v = 0;
+        for(idx=0; idx!=dev->width; idx++) v |= ((crc[idx] >> (15 - k)) & 1) << idx;
+        SDB_Clock(rel | v);
+    }
+    SDB_Clock(SDB_IDLE);
+    // CRC status on DAT0: start bit, 3 bits (010 accepted) and end bit
+    for(k=0; (k!=SDB_NCR) && (SDB_Clock(SDB_IDLE) & SDB_DAT0); k++);
+    if(k == SDB_NCR) return(SD_NORESPONSE);
+    st = 0;
+    for(k=0; k!=3; k++) st = (st << 1) | (SDB_Clock(SDB_IDLE) & SDB_DAT0);
+    SDB_Clock(SDB_IDLE);
+    if(st != 0x02) return(SD_REJECT);
+    return(__SDB_Wait_Busy(SD_IO_WRITE_TIMEOUT_WAIT));
+}
+
+/**
+    \brief Stop a multiple block transfer (CMD12, R1b).
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDB_Stop(SDB_DEV *dev)
+{
+    SDRESULTS res;
+    uint8_t r[6];
+    res = __SDB_Cmd(dev, CMD12, 0, SDB_RSP_R1, r, 0);
+    if(__SDB_Wait_Busy(SD_IO_WRITE_TIMEOUT_WAIT) != SD_OK) res = SD_BUSY;
+    return(res);
+}
+
+/**
+    \brief Get the total numbers of sectors from the CSD register.
+    \param csd CSD register (16 bytes).
+    \return Quantity of sectors.
+ */
+static uint32_t __SDB_Sectors(const uint8_t *csd)
+{
+    uint32_t c_size;
+    uint8_t mult;
+    // CSD_STRUCTURE[127:126]: version 2.0 (SDHC/SDXC)?
+    if((csd[0] >> 6) == 1) {
+        // C_SIZE [69:48], capacity is (C_SIZE + 1) * 512 KiB
+        c_size = ((uint32_t)(csd[7] & 0x3F) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+        return((c_size + 1) << 10);
+    }
+    // C_SIZE [73:62], C_SIZE_MULT [49:47] and READ_BL_LEN [83:80]
+    c_size = ((uint32_t)(csd[6] & 0x03) << 10) | ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+    mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+    return(((c_size + 1) << (mult + 2 + (csd[5] & 0x0F))) / SD_BLK_SIZE);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Bus_Init(SDB_DEV *dev)
+{
+    SDRESULTS res;
+    uint8_t r[17], idx;
+    uint32_t hcs;
+    dev->mount = FALSE;
+    dev->cardtype = 0;
+    dev->width = 1;
+    dev->rca = 0;
+    SDB_Init();
+    SDB_Freq_Low();
+    // 80 clocks with CMD high, then the supply must be stable
+    for(idx=0; idx!=80; idx++) SDB_Clock(SDB_IDLE);
+    SDB_Timer_On(SD_IO_POWERUP_WAIT);
+    while(SDB_Timer_Status()==TRUE);
+    SDB_Timer_Off();
+    __SDB_Cmd(dev, CMD0, 0, SDB_RSP_NONE, r, 0);
+    // SD version 2?
+    hcs = 0;
+    if(__SDB_Cmd(dev, CMD8, 0x1AA, SDB_RSP_R7, r, 0) == SD_OK) {
+        if(((r[3] & 0x0F) != 0x01) || (r[4] != 0xAA)) return(SD_NOINIT);
+        hcs = 1UL << 30;
+    }
+    // Wait for the end of power up (OCR[31]), the voltage window is required
+    SDB_Timer_On(SD_IO_INIT_TIMEOUT_WAIT);
+    do {
+        res = __SDB_Cmd(dev, ACMD41, hcs | SDB_OCR_VDD, SDB_RSP_R3, r, 0);
+    } while((res == SD_OK) && !(r[1] & 0x80) && (SDB_Timer_Status()==TRUE));
+    SDB_Timer_Off();
+    if((res != SD_OK) || !(r[1] & 0x80)) return(SD_NOINIT);
+    if(!hcs) dev->cardtype = SDCT_SD1;
+    else dev->cardtype = (r[1] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
+    // Identification: CID, then the card publishes its address
+    if(__SDB_Cmd(dev, CMD2, 0, SDB_RSP_R2, r, 0) != SD_OK) return(SD_NOINIT);
+    if(__SDB_Cmd(dev, CMD3, 0, SDB_RSP_R7, r, 0) != SD_OK) return(SD_NOINIT);
+    dev->rca = ((uint16_t)r[1] << 8) | r[2];
+    // Capacity from the CSD (R2 carries it from the second byte)
+    if(__SDB_Cmd(dev, CMD9, (uint32_t)dev->rca << 16, SDB_RSP_R2, r, 0) != SD_OK) return(SD_NOINIT);
+    dev->last_sector = __SDB_Sectors(r + 1) - 1;
+    // Select the card: transfer state
+    if(__SDB_Cmd(dev, CMD7, (uint32_t)dev->rca << 16, SDB_RSP_R1, r, 0) != SD_OK) return(SD_NOINIT);
+    if(__SDB_Wait_Busy(SD_IO_WRITE_TIMEOUT_WAIT) != SD_OK) return(SD_NOINIT);
+#if SD_BUS_WIDTH == 4
+    if(__SDB_Cmd(dev, ACMD6, 0x02, SDB_RSP_R1, r, 0) != SD_OK) return(SD_NOINIT);
+    dev->width = 4;
+#endif
+    if(!(dev->cardtype & SDCT_BLOCK) && (__SDB_Cmd(dev, CMD16, SD_BLK_SIZE, SDB_RSP_R1, r, 0) != SD_OK))
+        return(SD_NOINIT);
+    SDB_Freq_High();
+    dev->mount = TRUE;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Bus_Read(SDB_DEV *dev, void *dat, uint32_t sector)
+{
+    SDB_PKT pkt;
+    uint8_t r[6];
+    if(!dev->mount) return(SD_NOINIT);
+    if(sector > dev->last_sector) return(SD_PARERR);
+    __SDB_Pkt_Init(&pkt, dat, SD_BLK_SIZE);
+    return(__SDB_Cmd(dev, CMD17, __SDB_Addr(dev, sector), SDB_RSP_R1, r, &pkt));
+}
+
+SDRESULTS SD_Bus_Write(SDB_DEV *dev, const void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    uint8_t r[6];
+    if(!dev->mount) return(SD_NOINIT);
+    if(sector > dev->last_sector) return(SD_PARERR);
+    res = __SDB_Cmd(dev, CMD24, __SDB_Addr(dev, sector), SDB_RSP_R1, r, 0);
+    if(res == SD_OK) res = __SDB_Tx_Data(dev, (const uint8_t*)dat);
+    return(res);
+}
+
+SDRESULTS SD_Bus_Read_Blocks(SDB_DEV *dev, void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    SDB_PKT pkt;
+    uint8_t r[6];
+    if(!dev->mount) return(SD_NOINIT);
+    if((count == 0)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+    __SDB_Pkt_Init(&pkt, dat, SD_BLK_SIZE);
+    res = __SDB_Cmd(dev, CMD18, __SDB_Addr(dev, sector), SDB_RSP_R1, r, &pkt);
+    while((res == SD_OK) && --count) {
+        dat = (uint8_t*)dat + SD_BLK_SIZE;
+        __SDB_Pkt_Init(&pkt, dat, SD_BLK_SIZE);
+        res = __SDB_Rx_Data(dev, &pkt);
+    }
+    if((__SDB_Stop(dev) != SD_OK) && (res == SD_OK)) res = SD_ERROR;
+    return(res);
+}
+
+SDRESULTS SD_Bus_Write_Blocks(SDB_DEV *dev, const void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint8_t r[6];
+    if(!dev->mount) return(SD_NOINIT);
+    if((count == 0)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+    res = __SDB_Cmd(dev, CMD25, __SDB_Addr(dev, sector), SDB_RSP_R1, r, 0);
+    if(res != SD_OK) return(res);
+    do {
+        res = __SDB_Tx_Data(dev, (const uint8_t*)dat);
+        dat = (const uint8_t*)dat + SD_BLK_SIZE;
+    } while((res == SD_OK) && --count);
+    if((__SDB_Stop(dev) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
+    return(res);
+}
+
+SDRESULTS SD_Bus_Status(SDB_DEV *dev)
+{
+    SDRESULTS res;
+    uint8_t r[6];
+    if(!dev->mount) return(SD_NOINIT);
+    res = __SDB_Cmd(dev, CMD13, (uint32_t)dev->rca << 16, SDB_RSP_R1, r, 0);
+    // CURRENT_STATE[12:9] must be transfer (4) and READY_FOR_DATA[8] set
+    if((res == SD_OK) && ((r[3] & 0x1F) != 0x09)) res = SD_BUSY;
+    return(res);
+}
@@ -0,0 +1,85 @@
+/*
+ * sd_bus.h: Native SD bus mode protocol engine (1 or 4-bit data bus).
+ * See LICENSE.
+ *
+ * An alternative to the SPI mode of sd_io.c for hosts that can drive the
+ * CLK, CMD and DAT[3:0] lines of the card, through the port of sdbus_io.h.
+ * The engine runs the whole protocol: identification (CMD2, CMD3),
+ * selection (CMD7), the 4-bit data bus (ACMD6), the CRC7 of commands and
+ * responses and the CRC16 of each DAT line. Only SD cards are supported.
+ */
+
+#ifndef _SD_BUS_H_
+#define _SD_BUS_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+#include "sdbus_io.h"
+
+#define SDB_OCR_VDD     0x00FF8000UL    /* Voltage window 2.7-3.6V          */
+#define SDB_NCR         64              /* Max clocks before a response     */
+
+/* Native bus device object */
+typedef struct _SDB_DEV {
+    uint8_t mount;
+    uint8_t cardtype;       /* SDCT_* flags                         */
+    uint8_t width;          /* Data bus width (1 or 4)              */
+    uint16_t rca;           /* Relative card address                */
+    uint32_t last_sector;
+} SDB_DEV;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Identify, select and initialize the card.
+    \details The data bus is set to SD_BUS_WIDTH lines.
+    \param dev Device object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Bus_Init(SDB_DEV *dev);
+
+/**
+    \brief Read a single block.
+    \param dat Destination (512 bytes).
+    \param sector Sector number.
+    \return If all goes well returns SD_OK, SD_ERROR on a CRC error.
+ */
+SDRESULTS SD_Bus_Read(SDB_DEV *dev, void *dat, uint32_t sector);
+
+/**
+    \brief Write a single block.
+    \param dat Data to write (512 bytes).
+    \param sector Sector number.
+    \return If all goes well returns SD_OK, SD_REJECT if the card reports
+    a CRC or write error.
+ */
+SDRESULTS SD_Bus_Write(SDB_DEV *dev, const void *dat, uint32_t sector);
+
+/**
+    \brief Read consecutive blocks (CMD18, stopped with CMD12).
+    \param dat Destination (count * 512 bytes).
+    \param sector Start sector number.
+    \param count Number of sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Bus_Read_Blocks(SDB_DEV *dev, void *dat, uint32_t sector, uint32_t count);
+
+/**
+    \brief Write consecutive blocks (CMD25, stopped with CMD12).
+    \param dat Data to write (count * 512 bytes).
+    \param sector Start sector number.
+    \param count Number of sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Bus_Write_Blocks(SDB_DEV *dev, const void *dat, uint32_t sector, uint32_t count);
+
+/**
+    \brief Allows know status of the card (CMD13).
+    \return SD_OK if the card is ready in transfer state.
+ */
+SDRESULTS SD_Bus_Status(SDB_DEV *dev);
+
+#endif
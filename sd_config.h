@@ -0,0 +1,165 @@
+/*
+ * sd_config.h: Compile-time configuration of the SD driver.
+ * See LICENSE.
+ *
+ * Every setting can be overridden from the compiler command line or from a
+ * header included before sd_io.h. Switching off card types that are never
+ * used removes their paths from SD_Init and from the register decoding; an
+ * SDHC/SDXC only build is
+ *
+ *     -DSD_IO_MMC=0 -DSD_IO_SD1=0 -DSD_IO_SDSC=0
+ */
+
+#ifndef _SD_CONFIG_H_
+#define _SD_CONFIG_H_
+
+/******************************************************************************
+ Supported cards
+******************************************************************************/
+
+/* MMC (CMD1 initialization, erase groups) and MMCv4/eMMC in sector mode
+   (EXT_CSD capacity) */
+#ifndef SD_IO_MMC
+#define SD_IO_MMC           1
+#endif
+
+/* MMCv4 high speed timing (HS_TIMING of the EXT_CSD), clock raised to 26 or
+   52 MHz by SPI_Freq_Card */
+#ifndef SD_IO_MMC_HS
+#define SD_IO_MMC_HS        0
+#endif
+
+/* SD version 1 (no CMD8, ACMD41 without HCS) */
+#ifndef SD_IO_SD1
+#define SD_IO_SD1           1
+#endif
+
+/* Byte addressed cards: SDSC, SDv1 and MMC up to 2 GB (CSD version 1,
+   partial reads) */
+#ifndef SD_IO_SDSC
+#define SD_IO_SDSC          1
+#endif
+
+#if !SD_IO_SDSC && SD_IO_SD1
+#error "SDv1 cards are byte addressed, they need SD_IO_SDSC"
+#endif
+
+/******************************************************************************
+ Features
+******************************************************************************/
+
+/* CRC7 on commands and CRC16 on data packets (CMD59), checked on reads */
+#ifndef SD_IO_CRC
+#define SD_IO_CRC           0
+#endif
+
+/* Recovery counters of SD_DEV (SD_STATS) */
+#ifndef SD_IO_STATS
+#define SD_IO_STATS         1
+#endif
+
+/* Sector cache (SD_Cache), 0 strips it */
+#ifndef SD_IO_CACHE
+#define SD_IO_CACHE         1
+#endif
+
+/* SD_Write skips sectors whose content doesn't change: compared with the
+   cached copy or with a 32-bit hash of the last write (SD_Skip) */
+#ifndef SD_IO_SKIP
+#define SD_IO_SKIP          0
+#endif
+
+/* Map of sector ranges known to be erased (SD_Erased), read without the card */
+#ifndef SD_IO_ERASED
+#define SD_IO_ERASED        0
+#endif
+
+/* Preemptible multiple block reads (SD_Read_Job, SD_Preempt) */
+#ifndef SD_IO_ASYNC
+#define SD_IO_ASYNC         0
+#endif
+
+/* Longest SD_Read done with a reduced block length (CMD16), 0 disables it */
+#ifndef SD_IO_PARTIAL_MAX
+#define SD_IO_PARTIAL_MAX   448
+#endif
+
+/* Longest run of sectors of a single SD_Read_Bytes transfer (1..127) */
+#ifndef SD_IO_BYTES_RUN
+#define SD_IO_BYTES_RUN     64
+#endif
+
+#if SD_IO_BYTES_RUN > 127
+#error "A SD_Read_Bytes run must fit the 16-bit length of a SD_IOVEC"
+#endif
+
+/* Cards on the bus, each one with its own CS (SPI_CS_Sel, SD_Init_All) */
+#ifndef SD_IO_CARDS
+#define SD_IO_CARDS         1
+#endif
+
+#if SD_IO_MMC_HS && (SD_IO_CARDS > 1)
+#error "SD_IO_MMC_HS raises the clock shared by all the cards, use one card"
+#endif
+
+/* Retry policy of SD_Read/SD_Write and the multiple block transfers */
+#ifndef SD_IO_RETRYS
+#define SD_IO_RETRYS        0x02    /* Retries after a failed operation     */
+#endif
+#ifndef SD_IO_RETRY_REINIT
+#define SD_IO_RETRY_REINIT  1       /* Escalate to re-init if card is lost  */
+#endif
+
+/* End of busy: 0 clocks 0xFF bytes, 1 polls the DO line (SPI_DO_Level)
+   without clocks, 2 sleeps until DO rises (SPI_DO_Wait) */
+#ifndef SD_IO_BUSY_SENSE
+#define SD_IO_BUSY_SENSE    0
+#endif
+
+/* Timing probes around each driver phase (SPI_Probe_Begin/End) */
+#ifndef SD_IO_PROBE
+#define SD_IO_PROBE         0
+#endif
+
+/* Data bus width of the native SD bus engine (sd_bus.c): 1 or 4 */
+#ifndef SD_BUS_WIDTH
+#define SD_BUS_WIDTH        4
+#endif
+
+/******************************************************************************
+ Timeouts (milliseconds) and attempts
+******************************************************************************/
+
+#ifndef SD_IO_WRITE_TIMEOUT_WAIT
+#define SD_IO_WRITE_TIMEOUT_WAIT    250     /* End of programming           */
+#endif
+#ifndef SD_IO_READ_TIMEOUT_WAIT
+#define SD_IO_READ_TIMEOUT_WAIT     100     /* Start token of a data packet */
+#endif
+#ifndef SD_IO_ERASE_TIMEOUT_WAIT
+#define SD_IO_ERASE_TIMEOUT_WAIT    30000   /* End of an erase              */
+#endif
+#ifndef SD_IO_CMD_TIMEOUT_WAIT
+#define SD_IO_CMD_TIMEOUT_WAIT      5       /* Command response             */
+#endif
+#ifndef SD_IO_POWERUP_WAIT
+#define SD_IO_POWERUP_WAIT          500     /* Supply ramp after power up   */
+#endif
+#ifndef SD_IO_REMOUNT_WAIT
+#define SD_IO_REMOUNT_WAIT          2       /* Same, on SD_Remount          */
+#endif
+#ifndef SD_IO_IDLE_TIMEOUT_WAIT
+#define SD_IO_IDLE_TIMEOUT_WAIT     500     /* CMD0 until idle state        */
+#endif
+#ifndef SD_IO_INIT_TIMEOUT_WAIT
+#define SD_IO_INIT_TIMEOUT_WAIT     1000    /* ACMD41 (HCS) on SDv2         */
+#endif
+#ifndef SD_IO_INIT_V1_TIMEOUT_WAIT
+#define SD_IO_INIT_V1_TIMEOUT_WAIT  250     /* ACMD41/CMD1 on SDv1 and MMC  */
+#endif
+
+#ifndef SD_INIT_TRYS
+#define SD_INIT_TRYS                0x03    /* Attempts of SD_Init          */
+#endif
+
+#endif
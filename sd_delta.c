@@ -0,0 +1,202 @@
+/*
+ * sd_delta.c: Delta + varint compressed sample streams on raw SD sectors.
+ * See LICENSE.
+ */
+
+#include <string.h>
+
+#include "sd_delta.h"
+#include "sd_util.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Encode a variable length integer (7 bits per byte, LSB first).
+    \param p Destination (5 bytes at most).
+    \param v Value.
+    \return Bytes written.
+ */
+static uint8_t __SDD_Put_Var(uint8_t *p, uint32_t v)
+{
+    uint8_t n;
+    n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return(n);
+}
+
+/**
+    \brief Decode a variable length integer.
+    \param p Source.
+    \param left Bytes available.
+    \param v Returns the value.
+    \return Bytes read, 0 if malformed.
+ */
+static uint8_t __SDD_Get_Var(const uint8_t *p, uint16_t left, uint32_t *v)
+{
+    uint8_t n;
+    *v = 0;
+    for (n = 0; (n != 5)&&(n != left); n++) {
+        *v |= (uint32_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) return(n + 1);
+    }
+    return(0);
+}
+
+/**
+    \brief Encode a record.
+    \param p Destination.
+    \param room Bytes available.
+    \param smp Samples.
+    \param n Number of samples.
+    \return Bytes written, 0 if the record doesn't fit.
+ */
+static uint16_t __SDD_Encode(uint8_t *p, uint16_t room, const int32_t *smp, uint16_t n)
+{
+    uint8_t tmp[5];
+    uint8_t k;
+    uint16_t len, idx;
+    uint32_t prev, d;
+    len = __SDD_Put_Var(tmp, n);
+    if (len > room) return(0);
+    memcpy(p, tmp, len);
+    prev = 0;
+    for (idx = 0; idx != n; idx++) {
+        // Zigzag keeps small negative differences small
+        d = (uint32_t)smp[idx] - prev;
+        prev = (uint32_t)smp[idx];
+        k = __SDD_Put_Var(tmp, (d << 1) ^ (uint32_t)((int32_t)d >> 31));
+        if (len + k > room) return(0);
+        memcpy(p + len, tmp, k);
+        len += k;
+    }
+    return(len);
+}
+
+/**
+    \brief Write the sector buffer of a writer.
+    \details The sector goes into the write session of the stream, which is
+    closed at the end of the stream area.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDD_Put_Block(SD_DELTA_W *w)
+{
+    SDRESULTS res;
+    if (w->sector >= w->end) return(SD_PARERR);
+    __SDU_Put16(w->buf, SDD_MAGIC);
+    __SDU_Put16(w->buf + 2, w->used);
+    __SDU_Put32(w->buf + 4, w->seq);
+    memset(w->buf + SDD_HDR_SIZE + w->used, 0, SDD_DATA_SIZE - w->used);
+    res = __SDU_Put_Sector(w->dev, w->buf, w->sector, 0);
+    if (res != SD_OK) return(res);
+    w->sector++;
+    w->seq++;
+    w->used = 0;
+    w->packed += SD_BLK_SIZE;
+    if (w->sector == w->end) res = SD_Write_Close(w->dev);
+    return(res);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Delta_Open(SD_DELTA_W *w, SD_DEV *dev, uint32_t first, uint32_t sectors, uint32_t seq)
+{
+    if ((first > dev->last_sector)||(sectors == 0)||(sectors - 1 > dev->last_sector - first)) return(SD_PARERR);
+    w->dev = dev;
+    w->sector = first;
+    w->end = first + sectors;
+    w->seq = seq;
+    w->raw = 0;
+    w->packed = 0;
+    w->used = 0;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Delta_Put(SD_DELTA_W *w, const int32_t *smp, uint16_t n)
+{
+    SDRESULTS res;
+    uint16_t len;
+    if (n == 0) return(SD_PARERR);
+    len = __SDD_Encode(w->buf + SDD_HDR_SIZE + w->used, SDD_DATA_SIZE - w->used, smp, n);
+    // Doesn't fit: start a new sector
+    if (!len) {
+        if (!w->used) return(SD_PARERR);
+        res = __SDD_Put_Block(w);
+        if (res != SD_OK) return(res);
+        len = __SDD_Encode(w->buf + SDD_HDR_SIZE, SDD_DATA_SIZE, smp, n);
+        if (!len) return(SD_PARERR);
+    }
+    w->used += len;
+    w->raw += (uint32_t)n * sizeof(int32_t);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Delta_Sync(SD_DELTA_W *w)
+{
+    SDRESULTS res;
+    res = SD_OK;
+    if (w->used) res = __SDD_Put_Block(w);
+    if (res == SD_OK) res = SD_Write_Close(w->dev);
+    return(res);
+}
+
+SDRESULTS SD_Delta_Reader(SD_DELTA_R *r, SD_DEV *dev, uint32_t first, uint32_t sectors, uint32_t seq)
+{
+    if ((first > dev->last_sector)||(sectors == 0)||(sectors - 1 > dev->last_sector - first)) return(SD_PARERR);
+    r->dev = dev;
+    r->sector = first;
+    r->end = first + sectors;
+    r->seq = seq;
+    r->pos = 0;
+    r->used = 0;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Delta_Get(SD_DELTA_R *r, int32_t *smp, uint16_t max, uint16_t *n)
+{
+    SDRESULTS res;
+    const uint8_t *p;
+    uint32_t cnt, z, prev;
+    uint16_t pos, idx;
+    uint8_t k;
+    for (;;) {
+        if (r->pos < r->used) {
+            p = r->buf + SDD_HDR_SIZE;
+            pos = r->pos;
+            k = __SDD_Get_Var(p + pos, r->used - pos, &cnt);
+            if ((!k)||(cnt == 0)||(cnt > max)) return(SD_PARERR);
+            pos += k;
+            prev = 0;
+            for (idx = 0; idx != cnt; idx++) {
+                k = __SDD_Get_Var(p + pos, r->used - pos, &z);
+                if (!k) return(SD_PARERR);
+                pos += k;
+                prev += (z >> 1) ^ (0 - (z & 1));
+                smp[idx] = (int32_t)prev;
+            }
+            r->pos = pos;
+            *n = (uint16_t)cnt;
+            return(SD_OK);
+        }
+        // Next sector of the stream
+        if (r->sector >= r->end) return(SD_PARERR);
+        res = SD_Read(r->dev, r->buf, r->sector, 0, SD_BLK_SIZE);
+        if (res != SD_OK) return(res);
+        p = r->buf;
+        r->used = __SDU_Get16(p + 2);
+        if ((__SDU_Get16(p) != SDD_MAGIC)||(r->used > SDD_DATA_SIZE)||(__SDU_Get32(p + 4) != r->seq)) {
+            r->used = 0;
+            return(SD_PARERR);
+        }
+        r->sector++;
+        r->seq++;
+        r->pos = 0;
+    }
+}
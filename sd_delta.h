@@ -0,0 +1,102 @@
+/*
+ * sd_delta.h: Delta + varint compressed sample streams on raw SD sectors.
+ * See LICENSE.
+ *
+ * A record is a run of 32-bit samples. It is stored as the sample count and
+ * the zigzag encoded differences between consecutive samples, all as
+ * variable length integers, so slowly changing telemetry takes one or two
+ * bytes per sample. Records are packed in sectors that start with a framing
+ * header (mark, bytes used and a sequence number) and never cross a sector,
+ * so every sector can be decoded on its own.
+ */
+
+#ifndef _SD_DELTA_H_
+#define _SD_DELTA_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+#define SDD_MAGIC       0x4453                      /* Sector mark          */
+#define SDD_HDR_SIZE    8                           /* Framing header       */
+#define SDD_DATA_SIZE   (SD_BLK_SIZE - SDD_HDR_SIZE)
+
+/* Compressed stream writer */
+typedef struct _SD_DELTA_W {
+    SD_DEV *dev;
+    uint32_t sector;        /* Next sector to write                 */
+    uint32_t end;           /* First sector after the stream area   */
+    uint32_t seq;           /* Sequence number of the next sector   */
+    uint32_t raw;           /* Bytes of samples put                 */
+    uint32_t packed;        /* Bytes of sectors written             */
+    uint16_t used;          /* Bytes used of the data area of buf   */
+    uint8_t buf[SD_BLK_SIZE];
+} SD_DELTA_W;
+
+/* Compressed stream reader */
+typedef struct _SD_DELTA_R {
+    SD_DEV *dev;
+    uint32_t sector;        /* Next sector to read                  */
+    uint32_t end;           /* First sector after the stream area   */
+    uint32_t seq;           /* Sequence number of the next sector   */
+    uint16_t pos;           /* Next record in the data area of buf  */
+    uint16_t used;          /* Bytes used of the data area of buf   */
+    uint8_t buf[SD_BLK_SIZE];
+} SD_DELTA_R;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Start a compressed stream.
+    \param w Writer object.
+    \param dev Initialized device descriptor.
+    \param first First sector of the stream area.
+    \param sectors Sectors of the stream area.
+    \param seq Sequence number of the first sector (tells streams apart).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Delta_Open(SD_DELTA_W *w, SD_DEV *dev, uint32_t first, uint32_t sectors, uint32_t seq);
+
+/**
+    \brief Compress and append a record of samples.
+    \details Full sectors are streamed through a multiple block write
+    session that stays open until SD_Delta_Sync.
+    \param w Writer object.
+    \param smp Samples.
+    \param n Number of samples; the record must fit in one sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Delta_Put(SD_DELTA_W *w, const int32_t *smp, uint16_t n);
+
+/**
+    \brief Write the partly filled sector and close the write session.
+    \param w Writer object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Delta_Sync(SD_DELTA_W *w);
+
+/**
+    \brief Start reading a compressed stream.
+    \param r Reader object.
+    \param dev Initialized device descriptor.
+    \param first First sector of the stream area.
+    \param sectors Sectors of the stream area.
+    \param seq Sequence number of the first sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Delta_Reader(SD_DELTA_R *r, SD_DEV *dev, uint32_t first, uint32_t sectors, uint32_t seq);
+
+/**
+    \brief Read and decompress the next record.
+    \param r Reader object.
+    \param smp Destination of the samples.
+    \param max Room in smp.
+    \param n Returns the number of samples.
+    \return SD_OK with a record, SD_PARERR at the end of the stream or if
+    the record doesn't fit in smp.
+ */
+SDRESULTS SD_Delta_Get(SD_DELTA_R *r, int32_t *smp, uint16_t max, uint16_t *n);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * sd_index.c: Sparse time index for large raw logs on SD sectors.
+ * See LICENSE.
+ */
+
+#include <string.h>
+
+#include "sd_index.h"
+#include "sd_util.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Sector number of a data sector of a group.
+ */
+static inline uint32_t __SDX_Sector(SD_INDEX *ix, uint32_t g, uint8_t i)
+{
+    return ix->first + g * (ix->n + 1) + i;
+}
+
+/**
+    \brief Check the header of the index sector of a group.
+    \return TRUE if it belongs to this log.
+ */
+static uint8_t __SDX_Valid(SD_INDEX *ix, const uint8_t *hdr, uint32_t g)
+{
+    return ((__SDU_Get16(hdr) == SDX_MAGIC)&&(hdr[2] <= ix->n)&&(hdr[3] == ix->epoch)&&(__SDU_Get32(hdr + 4) == g)) ? TRUE : FALSE;
+}
+
+/**
+    \brief Read the index sector of a group, or take it from RAM if it is
+    the group being filled.
+    \param buf Destination (cnt bytes).
+    \param cnt Bytes to read from the start of the sector.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDX_Load(SD_INDEX *ix, uint32_t g, uint8_t *buf, uint16_t cnt)
+{
+    if (g == ix->group) {
+        memcpy(buf, ix->buf, cnt);
+        buf[2] = ix->cnt;
+        return(SD_OK);
+    }
+    return(SD_Read(ix->dev, buf, __SDX_Sector(ix, g, ix->n), 0, cnt));
+}
+
+/**
+    \brief Find the last group whose first data sector starts at or before t.
+    \param groups Groups with data.
+    \param t Timestamp.
+    \param g Returns the group, or groups if all of them start after t.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDX_Group_Of(SD_INDEX *ix, uint32_t groups, uint32_t t, uint32_t *g)
+{
+    SDRESULTS res;
+    uint8_t hdr[SDX_HDR_SIZE + 4];
+    uint32_t lo, hi, mid;
+    lo = 0;
+    hi = groups;
+    // Search the first group that starts after t
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        res = __SDX_Load(ix, mid, hdr, sizeof(hdr));
+        if (res != SD_OK) return(res);
+        if (__SDU_Get32(hdr + SDX_HDR_SIZE) <= t) lo = mid + 1;
+        else hi = mid;
+    }
+    *g = lo ? lo - 1 : groups;
+    return(SD_OK);
+}
+
+/**
+    \brief Find the last data sector of a group that starts at or before t.
+    \param blk Index sector of the group.
+    \param t Timestamp.
+    \return Data sector in the group (0 if none).
+ */
+static uint8_t __SDX_Entry_Of(const uint8_t *blk, uint32_t t)
+{
+    uint8_t i;
+    for (i = 1; i < blk[2]; i++)
+        if (__SDU_Get32(blk + SDX_HDR_SIZE + i * SDX_ENT_SIZE) > t) break;
+    return(i - 1);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Index_Open(SD_INDEX *ix, SD_DEV *dev, uint32_t first, uint32_t sectors, uint8_t n)
+{
+    SDRESULTS res;
+    uint32_t lo, hi, mid;
+    uint8_t hdr[SDX_HDR_SIZE];
+    if ((n == 0)||(n > SDX_ENTRIES)) return(SD_PARERR);
+    if ((first > dev->last_sector)||(sectors == 0)||(sectors - 1 > dev->last_sector - first)) return(SD_PARERR);
+    ix->dev = dev;
+    ix->first = first;
+    ix->n = n;
+    ix->groups = sectors / (n + 1);
+    if (ix->groups == 0) return(SD_PARERR);
+    ix->group = 0;
+    ix->cnt = 0;
+    ix->last_ts = 0;
+    res = SD_Read(dev, hdr, __SDX_Sector(ix, 0, n), 0, SDX_HDR_SIZE);
+    if (res != SD_OK) return(res);
+    // No log here yet
+    ix->epoch = hdr[3];
+    if (__SDX_Valid(ix, hdr, 0) == FALSE) {
+        ix->epoch = 0;
+        return(SD_OK);
+    }
+    // Index sectors are written in order: last group with a valid one
+    lo = 0;
+    hi = ix->groups - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        res = SD_Read(dev, hdr, __SDX_Sector(ix, mid, n), 0, SDX_HDR_SIZE);
+        if (res != SD_OK) return(res);
+        if (__SDX_Valid(ix, hdr, mid) == TRUE) lo = mid;
+        else hi = mid - 1;
+    }
+    res = SD_Read(dev, ix->buf, __SDX_Sector(ix, lo, n), 0, SD_BLK_SIZE);
+    if (res != SD_OK) return(res);
+    ix->group = lo;
+    ix->cnt = ix->buf[2];
+    if (ix->cnt) ix->last_ts = __SDU_Get32(ix->buf + SDX_HDR_SIZE + (ix->cnt - 1) * SDX_ENT_SIZE);
+    // Group complete, go on with the next one
+    if (ix->cnt == n) {
+        ix->group++;
+        ix->cnt = 0;
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_Index_Format(SD_INDEX *ix)
+{
+    ix->epoch++;
+    ix->group = 0;
+    ix->cnt = 0;
+    ix->last_ts = 0;
+    return(SD_Index_Flush(ix));
+}
+
+SDRESULTS SD_Index_Write(SD_INDEX *ix, const void *dat, uint32_t ts, uint16_t ofs)
+{
+    SDRESULTS res;
+    uint8_t *ent;
+    if ((ix->group >= ix->groups)||(ts < ix->last_ts)||(ofs >= SD_BLK_SIZE)) return(SD_PARERR);
+    res = SD_Write(ix->dev, (void*)dat, __SDX_Sector(ix, ix->group, ix->cnt));
+    if (res != SD_OK) return(res);
+    ent = ix->buf + SDX_HDR_SIZE + ix->cnt * SDX_ENT_SIZE;
+    __SDU_Put32(ent, ts);
+    __SDU_Put16(ent + 4, ofs);
+    ix->cnt++;
+    ix->last_ts = ts;
+    // Group complete?
+    if (ix->cnt == ix->n) return(SD_Index_Flush(ix));
+    return(SD_OK);
+}
+
+SDRESULTS SD_Index_Flush(SD_INDEX *ix)
+{
+    SDRESULTS res;
+    if (ix->group >= ix->groups) return(SD_OK);
+    __SDU_Put16(ix->buf, SDX_MAGIC);
+    ix->buf[2] = ix->cnt;
+    ix->buf[3] = ix->epoch;
+    __SDU_Put32(ix->buf + 4, ix->group);
+    res = SD_Write(ix->dev, ix->buf, __SDX_Sector(ix, ix->group, ix->n));
+    if ((res == SD_OK)&&(ix->cnt == ix->n)) {
+        ix->group++;
+        ix->cnt = 0;
+    }
+    return(res);
+}
+
+SDRESULTS SD_Index_Find(SD_INDEX *ix, uint32_t t0, uint32_t t1, uint32_t *first, uint32_t *count, uint16_t *ofs)
+{
+    SDRESULTS res;
+    uint8_t blk[SD_BLK_SIZE];
+    uint32_t groups, ga, gb, start;
+    uint8_t i;
+    *count = 0;
+    groups = ix->group + (ix->cnt ? 1 : 0);
+    if ((groups == 0)||(t0 > t1)) return(SD_OK);
+    // Last sector that starts at or before the end of the window
+    res = __SDX_Group_Of(ix, groups, t1, &gb);
+    if ((res != SD_OK)||(gb == groups)) return(res);
+    // Last sector that starts before the window (its tail can be inside)
+    ga = groups;
+    if (t0) {
+        res = __SDX_Group_Of(ix, groups, t0 - 1, &ga);
+        if (res != SD_OK) return(res);
+    }
+    if (ga == groups) {
+        ga = 0;
+        res = __SDX_Load(ix, 0, blk, SD_BLK_SIZE);
+        i = 0;
+    } else {
+        res = __SDX_Load(ix, ga, blk, SD_BLK_SIZE);
+        i = __SDX_Entry_Of(blk, t0 - 1);
+    }
+    if (res != SD_OK) return(res);
+    start = ga * ix->n + i;
+    *ofs = __SDU_Get16(blk + SDX_HDR_SIZE + i * SDX_ENT_SIZE + 4);
+    res = __SDX_Load(ix, gb, blk, SD_BLK_SIZE);
+    if (res != SD_OK) return(res);
+    *first = start;
+    *count = gb * ix->n + __SDX_Entry_Of(blk, t1) - start + 1;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Index_Read(SD_INDEX *ix, void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint32_t run;
+    uint8_t i;
+    uint8_t *p = (uint8_t *)dat;
+    if ((count == 0)||(sector + count > ix->group * ix->n + ix->cnt)) return(SD_PARERR);
+    do {
+        // Consecutive data sectors up to the next index sector
+        i = sector % ix->n;
+        run = ix->n - i;
+        if (run > count) run = count;
+        if (run == 1)
+            res = SD_Read(ix->dev, p, __SDX_Sector(ix, sector / ix->n, i), 0, SD_BLK_SIZE);
+        else
+            res = SD_Read_Blocks(ix->dev, p, __SDX_Sector(ix, sector / ix->n, i), run);
+        if (res != SD_OK) return(res);
+        p += run * SD_BLK_SIZE;
+        sector += run;
+        count -= run;
+    } while (count);
+    return(SD_OK);
+}
@@ -0,0 +1,102 @@
+/*
+ * sd_index.h: Sparse time index for large raw logs on SD sectors.
+ * See LICENSE.
+ *
+ * The log area is split in groups of N data sectors followed by one index
+ * sector. The index sector holds, for each data sector of its group, the
+ * timestamp of the first record and the offset where that record starts.
+ * A time window is then found by a binary search over the index sectors
+ * instead of a scan of the data.
+ */
+
+#ifndef _SD_INDEX_H_
+#define _SD_INDEX_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+#define SDX_MAGIC       0x5853                      /* Index sector mark    */
+#define SDX_HDR_SIZE    8                           /* Index sector header  */
+#define SDX_ENT_SIZE    6                           /* Timestamp + offset   */
+#define SDX_ENTRIES     ((SD_BLK_SIZE - SDX_HDR_SIZE) / SDX_ENT_SIZE)
+
+/* Indexed log object */
+typedef struct _SD_INDEX {
+    SD_DEV *dev;
+    uint32_t first;         /* First sector of the log area             */
+    uint32_t groups;        /* Groups that fit in the area              */
+    uint32_t group;         /* Group being filled                       */
+    uint32_t last_ts;       /* Timestamp of the last data sector        */
+    uint8_t n;              /* Data sectors per group                   */
+    uint8_t cnt;            /* Data sectors written in the group        */
+    uint8_t epoch;          /* Tells this log from older ones           */
+    uint8_t buf[SD_BLK_SIZE];   /* Index sector of the group            */
+} SD_INDEX;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Open an indexed log and find where it ends.
+    \details The last index sector is found by binary search. Data sectors
+    written after the last SD_Index_Flush aren't indexed and are written
+    again. An area used before for another log must be SD_Index_Format'ed.
+    \param ix Indexed log object.
+    \param dev Initialized device descriptor.
+    \param first First sector of the log area.
+    \param sectors Sectors of the log area.
+    \param n Data sectors per group (1..SDX_ENTRIES).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Open(SD_INDEX *ix, SD_DEV *dev, uint32_t first, uint32_t sectors, uint8_t n);
+
+/**
+    \brief Start an empty log on an opened area.
+    \param ix Indexed log object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Format(SD_INDEX *ix);
+
+/**
+    \brief Append a data sector.
+    \param ix Indexed log object.
+    \param dat Data of the sector (512 bytes).
+    \param ts Timestamp of the first record in the sector (non decreasing).
+    \param ofs Offset of the first record that starts in the sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Write(SD_INDEX *ix, const void *dat, uint32_t ts, uint16_t ofs);
+
+/**
+    \brief Write the index sector of the group being filled.
+    \param ix Indexed log object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Flush(SD_INDEX *ix);
+
+/**
+    \brief Find the data sectors that hold a time window.
+    \details Uses a few SD_Read calls (O(log groups)) and 512 bytes of stack.
+    \param ix Indexed log object.
+    \param t0 Start of the window.
+    \param t1 End of the window (included).
+    \param first Returns the first data sector (counted from 0).
+    \param count Returns the number of data sectors, 0 if there isn't data.
+    \param ofs Returns the offset of the first record in the first sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Find(SD_INDEX *ix, uint32_t t0, uint32_t t1, uint32_t *first, uint32_t *count, uint16_t *ofs);
+
+/**
+    \brief Read data sectors, skipping the index sectors.
+    \param ix Indexed log object.
+    \param dat Pointer to the destination object (count * 512 bytes).
+    \param sector First data sector (counted from 0).
+    \param count Number of data sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Index_Read(SD_INDEX *ix, void *dat, uint32_t sector, uint32_t count);
+
+#endif
@@ -3,11 +3,39 @@
  * See LICENSE.
  */
 
+#include <string.h>
+
 #include "sd_io.h"
+#include "sd_util.h"
+
+/* Position in the segments of a vectored transfer */
+typedef struct _SD_IOCUR {
+    const SD_IOVEC *iov;    /* Current segment          */
+    uint8_t left;           /* Segments from iov on     */
+    uint16_t ofs;           /* Byte offset in iov       */
+} SD_IOCUR;
+
+#if SD_IO_STATS
+#define __SD_Count(dev, n) ((dev)->stats.n++)
+#else
+#define __SD_Count(dev, n)
+#endif
+
+#if SD_IO_CRC
+/* CRC16 of the data packet in progress */
+static uint16_t __SD_Crc16;
+#define __SD_Crc_Start() (__SD_Crc16 = 0)
+#else
+#define __SD_Crc_Start()
+#endif
+
 /******************************************************************************
  Private Methods - Direct work with SD card
 ******************************************************************************/
 
+static SDRESULTS __SD_Init(SD_DEV *dev);
+static uint8_t __SD_Retry(SD_DEV *dev, SDRESULTS res, uint8_t trys);
+
 /**
     \brief Simple function to calculate power of two.
     \param e Exponent.
@@ -18,6 +46,41 @@ static inline uint32_t __SD_Power_Of_Two(uint8_t e)
     return ((uint32_t) 1) << e;
 }
 
+/**
+    \brief Convert a sector number to the address argument of the card.
+    \param dev Device descriptor.
+    \param sector Sector number.
+    \return Sector number on block addressed cards, byte address otherwise.
+*/
+static inline uint32_t __SD_Addr(SD_DEV *dev, uint32_t sector)
+{
+#if SD_IO_SDSC
+    return (dev->cardtype & SDCT_BLOCK) ? sector : sector * SD_BLK_SIZE;
+#else
+    (void)dev;
+    return sector;
+#endif
+}
+
+#if SD_IO_CRC
+/**
+    \brief Add a byte to the CRC7 of a command.
+    \param crc CRC so far.
+    \param d Byte.
+    \return New CRC (7 bits).
+ */
+static uint8_t __SD_Crc7(uint8_t crc, uint8_t d)
+{
+    uint8_t bit;
+    for(bit=0; bit!=8; bit++) {
+        crc <<= 1;
+        if((d ^ crc) & 0x80) crc ^= 0x09;
+        d <<= 1;
+    }
+    return(crc & 0x7F);
+}
+#endif
+
 /**
      \brief Assert the SD card (SPI CS low).
  */
@@ -28,6 +91,26 @@ static inline uint32_t __SD_Power_Of_Two(uint8_t e)
  */
 #define __SD_Deassert(void) SPI_CS_High()
 
+#if SD_IO_CARDS > 1
+/* Card whose CS is driven now */
+static uint8_t __SD_Cs;
+
+/**
+    \brief Route CS to the card of a device.
+    \details The CS of the previous card is released first; nothing is done
+    if the card is the one already in use, so an open session survives.
+ */
+static void __SD_Select(SD_DEV *dev)
+{
+    if(dev->cs == __SD_Cs) return;
+    SPI_CS_High();
+    SPI_CS_Sel(dev->cs);
+    __SD_Cs = dev->cs;
+}
+#else
+#define __SD_Select(dev)
+#endif
+
 /**
     \brief Change to max the speed transfer.
     \param throttle
@@ -46,6 +129,9 @@ static void __SD_Speed_Transfer(uint8_t throttle) {
 static uint8_t __SD_Send_Cmd(uint8_t cmd, uint32_t arg)
 {
     uint8_t crc, res;
+#if SD_IO_CRC
+    uint8_t idx;
+#endif
     // ACMD«n» is the command sequence of CMD55-CMD«n»
     if(cmd & 0x80) {
         cmd &= 0x7F;
@@ -53,13 +139,16 @@ static uint8_t __SD_Send_Cmd(uint8_t cmd, uint32_t arg)
         if (res > 1) return (res);
     }
 
-    // Select the card
-    __SD_Deassert();
-    SPI_RW(0xFF);
-    __SD_Assert();
-    SPI_RW(0xFF);
+    // Select the card, but not in the middle of a multiple block read
+    if(cmd != CMD12) {
+        __SD_Deassert();
+        SPI_RW(0xFF);
+        __SD_Assert();
+        SPI_RW(0xFF);
+    }
 
     // Send complete command set
+    SD_PROBE_BEGIN(SD_PH_CMD);
     SPI_RW(cmd);                        // Start and command index
     SPI_RW((uint8_t)(arg >> 24));          // Arg[31-24]
     SPI_RW((uint8_t)(arg >> 16));          // Arg[23-16]
@@ -67,53 +156,260 @@ static uint8_t __SD_Send_Cmd(uint8_t cmd, uint32_t arg)
     SPI_RW((uint8_t)(arg >> 0 ));          // Arg[07-00]
 
     // CRC?
+#if SD_IO_CRC
+    crc = __SD_Crc7(0, cmd);
+    for(idx=4; idx; idx--) crc = __SD_Crc7(crc, (uint8_t)(arg >> (8 * (idx - 1))));
+    crc = (crc << 1) | 0x01;            // CRC and stop
+#else
     crc = 0x01;                         // Dummy CRC and stop
     if(cmd == CMD0) crc = 0x95;         // Valid CRC for CMD0(0)
     if(cmd == CMD8) crc = 0x87;         // Valid CRC for CMD8(0x1AA)
+#endif
     SPI_RW(crc);
 
+    // Skip the stuff byte that follows a stop transmission
+    if(cmd == CMD12) SPI_RW(0xFF);
+    SD_PROBE_END(SD_PH_CMD);
+
     // Receive command response
-    // Wait for a valid response in timeout of 5 milliseconds
-    SPI_Timer_On(5);
+    // Wait for a valid response
+    SD_PROBE_BEGIN(SD_PH_R1);
+    SPI_Timer_On(SD_IO_CMD_TIMEOUT_WAIT);
     do {
         res = SPI_RW(0xFF);
     } while((res & 0x80)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
+    SD_PROBE_END(SD_PH_R1);
     // Return with the response value
     return(res);
 }
 
+/**
+    \brief Wait until the card releases the busy state.
+    \details With SD_IO_BUSY_SENSE the DO line is watched without clocks;
+    the clocked loop then confirms the card is ready.
+    \param ms Timeout in milliseconds.
+    \return TRUE if the card is ready.
+ */
+static uint8_t __SD_Wait_Ready(uint16_t ms)
+{
+    uint8_t line;
+    SD_PROBE_BEGIN(SD_PH_BUSY);
+    SPI_Timer_On(ms);
+#if SD_IO_BUSY_SENSE == 2
+    SPI_DO_Wait(ms);
+#elif SD_IO_BUSY_SENSE
+    while((SPI_DO_Level()==FALSE)&&(SPI_Timer_Status()==TRUE));
+#endif
+    do {
+        line = SPI_RW(0xFF);
+    } while((line!=0xFF)&&(SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    SD_PROBE_END(SD_PH_BUSY);
+    return((line==0xFF) ? TRUE : FALSE);
+}
+
+/**
+    \brief Release the bus after a transaction.
+ */
+static void __SD_Release(void)
+{
+    SD_PROBE_BEGIN(SD_PH_RELEASE);
+    SPI_Release();
+    SD_PROBE_END(SD_PH_RELEASE);
+}
+
+/**
+    \brief Send bytes of a data packet.
+    \param dat Data, NULL sends 0xFF.
+    \param cnt Byte count.
+ */
+static void __SD_Tx_Bytes(const uint8_t *dat, uint16_t cnt)
+{
+    uint8_t d;
+    SD_PROBE_BEGIN(SD_PH_DATA);
+    while(cnt--) {
+        d = dat ? *dat++ : 0xFF;
+#if SD_IO_CRC
+        __SD_Crc16 = __SDU_Crc16_Byte(__SD_Crc16, d);
+#endif
+        SPI_RW(d);
+    }
+    SD_PROBE_END(SD_PH_DATA);
+}
+
+/**
+    \brief Receive bytes of a data packet.
+    \param dat Destination, NULL drops the bytes.
+    \param cnt Byte count.
+ */
+static void __SD_Rx_Bytes(uint8_t *dat, uint16_t cnt)
+{
+    uint8_t d;
+    SD_PROBE_BEGIN(SD_PH_DATA);
+    while(cnt--) {
+        d = SPI_RW(0xFF);
+#if SD_IO_CRC
+        __SD_Crc16 = __SDU_Crc16_Byte(__SD_Crc16, d);
+#endif
+        if(dat) *dat++ = d;
+    }
+    SD_PROBE_END(SD_PH_DATA);
+}
+
+/**
+    \brief Finish an incoming data packet: receive the CRC.
+    \return SD_OK, SD_ERROR if the CRC check is on and it doesn't match.
+ */
+static SDRESULTS __SD_Rx_End(void)
+{
+#if SD_IO_CRC
+    uint16_t crc;
+    SD_PROBE_BEGIN(SD_PH_CRC);
+    crc = (uint16_t)SPI_RW(0xFF) << 8;
+    crc |= SPI_RW(0xFF);
+    SD_PROBE_END(SD_PH_CRC);
+    return((crc == __SD_Crc16) ? SD_OK : SD_ERROR);
+#else
+    // Dummy CRC
+    SD_PROBE_BEGIN(SD_PH_CRC);
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    SD_PROBE_END(SD_PH_CRC);
+    return(SD_OK);
+#endif
+}
+
+/**
+    \brief Finish an outgoing data packet: CRC, data response and busy.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Tx_End(void)
+{
+    uint8_t resp;
+    SD_PROBE_BEGIN(SD_PH_CRC);
+#if SD_IO_CRC
+    SPI_RW((uint8_t)(__SD_Crc16 >> 8));
+    SPI_RW((uint8_t)__SD_Crc16);
+#else
+    /* Dummy CRC */
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+#endif
+    SD_PROBE_END(SD_PH_CRC);
+    // If not accepted, returns the reject error
+    SD_PROBE_BEGIN(SD_PH_TOKEN);
+    resp = SPI_RW(0xFF);
+    SD_PROBE_END(SD_PH_TOKEN);
+    if((resp & 0x1F) != 0x05) return(SD_REJECT);
+    // Waits until finish of data programming with a timeout
+    return((__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT)==TRUE) ? SD_OK : SD_BUSY);
+}
+
 /**
     \brief Write a data block on SD card.
     \param dat Storage the data to transfer.
     \param token Inidicates the type of transfer (single or multiple).
  */
-static SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, uint8_t token)
+static SDRESULTS __SD_Write_Block(SD_DEV *dev, const void *dat, uint8_t token)
 {
-    uint16_t idx;
-    uint8_t line;
     // Send token (single or multiple)
+    SD_PROBE_BEGIN(SD_PH_TOKEN);
     SPI_RW(token);
-    // Single block write?
-    if(token != 0xFD)
-    {
-        // Send block data
-        for(idx=0; idx!=SD_BLK_SIZE; idx++) SPI_RW(*((uint8_t*)dat + idx));
-        /* Dummy CRC */
-        SPI_RW(0xFF);
+    SD_PROBE_END(SD_PH_TOKEN);
+    // Stop token of a multiple block write? Busy starts a byte later
+    if(token == 0xFD) {
         SPI_RW(0xFF);
-        // If not accepted, returns the reject error
-        if((SPI_RW(0xFF) & 0x1F) != 0x05) return(SD_REJECT);
+        return((__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT)==TRUE) ? SD_OK : SD_BUSY);
     }
-    // Waits until finish of data programming with a timeout
-    SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
+    // Send block data
+    __SD_Crc_Start();
+    __SD_Tx_Bytes(dat, SD_BLK_SIZE);
+    return(__SD_Tx_End());
+}
+
+/**
+    \brief Wait for the start token of a data packet.
+    \return Token received, 0xFF if timeout.
+ */
+static uint8_t __SD_Wait_Token(void)
+{
+    uint8_t tkn;
+    SD_PROBE_BEGIN(SD_PH_TOKEN);
+    SPI_Timer_On(SD_IO_READ_TIMEOUT_WAIT);
     do {
-        line = SPI_RW(0xFF);
-    } while((line==0)&&(SPI_Timer_Status()==TRUE));
+        tkn = SPI_RW(0xFF);
+    } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
-    if(line==0) return(SD_BUSY);
-    else return(SD_OK);
+    SD_PROBE_END(SD_PH_TOKEN);
+    return(tkn);
+}
+
+/**
+    \brief Receive a complete data packet (token, data and CRC).
+    \param dat Pointer to the destination object to put data.
+    \param cnt Byte count of the packet.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Rx_Data(void *dat, uint16_t cnt)
+{
+    uint8_t tkn;
+    tkn = __SD_Wait_Token();
+    if(tkn==0xFF) return(SD_NORESPONSE);
+    if(tkn!=0xFE) return(SD_ERROR);
+    __SD_Crc_Start();
+    __SD_Rx_Bytes(dat, cnt);
+    return(__SD_Rx_End());
+}
+
+/**
+    \brief Read the CSD register.
+    \param csd Destination of the 16 bytes of the register.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Read_Csd(uint8_t *csd)
+{
+    SDRESULTS res;
+    res = SD_ERROR;
+    if(__SD_Send_Cmd(CMD9, 0)==0) res = __SD_Rx_Data(csd, 16);
+    __SD_Release();
+    return(res);
+}
+
+#if SD_IO_MMC
+/**
+    \brief Read the fields used of the EXT_CSD register of a MMCv4 card.
+    \details The 512 bytes are streamed, only CARD_TYPE and SEC_COUNT are
+    kept.
+    \param type Destination of CARD_TYPE [196] (bit 0: 26 MHz, bit 1: 52 MHz).
+    \param sec Destination of SEC_COUNT [215:212], sectors of a sector mode
+    card.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Read_Ext_Csd(uint8_t *type, uint32_t *sec)
+{
+    SDRESULTS res;
+    uint8_t tkn, b[4];
+    res = SD_ERROR;
+    // CMD8 is SEND_EXT_CSD on MMC: a data packet, not a R7
+    if(__SD_Send_Cmd(CMD8, 0)==0) {
+        tkn = __SD_Wait_Token();
+        if(tkn==0xFF) res = SD_NORESPONSE;
+        else if(tkn==0xFE) {
+            __SD_Crc_Start();
+            __SD_Rx_Bytes(0, 196);
+            __SD_Rx_Bytes(type, 1);
+            __SD_Rx_Bytes(0, 15);
+            __SD_Rx_Bytes(b, 4);
+            __SD_Rx_Bytes(0, SD_BLK_SIZE - 216);
+            res = __SD_Rx_End();
+            *sec = ((uint32_t)b[3] << 24) | ((uint32_t)b[2] << 16) | ((uint32_t)b[1] << 8) | b[0];
+        }
+    }
+    __SD_Release();
+    return(res);
 }
+#endif
 
 /**
     \brief Get the total numbers of sectors in SD card.
@@ -123,22 +419,46 @@ static SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, uint8_t token)
 static uint32_t __SD_Sectors (SD_DEV *dev)
 {
     uint8_t csd[16];
-    uint8_t idx;
-    uint32_t ss;
-    uint16_t C_SIZE = 0;
+    uint8_t v2;
+    uint32_t ss = 0;
+    uint32_t C_SIZE = 0;
+#if SD_IO_SDSC
     uint8_t C_SIZE_MULT = 0;
     uint8_t READ_BL_LEN = 0;
-    if(__SD_Send_Cmd(CMD9, 0)==0) 
+#endif
+    if(__SD_Read_Csd(csd)==SD_OK)
     {
-        // Wait for response
-        while (SPI_RW(0xFF) == 0xFF);
-        for (idx=0; idx!=16; idx++) csd[idx] = SPI_RW(0xFF);
-        // Dummy CRC
-        SPI_RW(0xFF);
-        SPI_RW(0xFF);
-        SPI_Release();
-        if(dev->cardtype & SDCT_SD1)
+        // CSD_STRUCTURE[127:126]: version 2.0 (SDHC/SDXC)?
+        v2 = ((csd[0] >> 6) == 1) ? TRUE : FALSE;
+#if SD_IO_MMC
+        // Sector mode MMC (above 2 GB): C_SIZE is a dummy, SEC_COUNT of the
+        // EXT_CSD (SPEC_VERS[125:122] 4 or later) is the capacity
+        if((dev->cardtype & (SDCT_MMC|SDCT_BLOCK)) == (SDCT_MMC|SDCT_BLOCK)) {
+            uint8_t type;
+            if(((csd[0] >> 2) & 0x0F) < 4) return (0);
+            if(__SD_Read_Ext_Csd(&type, &ss) != SD_OK) return (0);
+            return (ss);
+        }
+        // Byte addressed MMC: CSD_STRUCTURE 1 is v1.1, the v1.0 layout
+        if(dev->cardtype & SDCT_MMC) v2 = FALSE;
+#endif
+        if(v2)
+        {
+            // C_SIZE [69:48], capacity is (C_SIZE + 1) * 512 KiB
+            C_SIZE = (csd[7] & 0x3F);
+            C_SIZE <<= 8;
+            C_SIZE |= (csd[8] & 0xFF);
+            C_SIZE <<= 8;
+            C_SIZE |= (csd[9] & 0xFF);
+            ss = (C_SIZE + 1);
+            ss <<= 10;
+        }
+#if SD_IO_SDSC
+        else
         {
+            // Version 1.0 (SDv1, SDSC v2 and MMC share this layout)
+            // READ_BL_PARTIAL[79]
+            if(csd[6] & 0x80) dev->cardtype |= SDCT_RDPART;
             // READ_BL_LEN[83:80]: max. read data block length
             READ_BL_LEN = (csd[5] & 0x0F);
             // C_SIZE [73:62]
@@ -151,161 +471,1571 @@ static uint32_t __SD_Sectors (SD_DEV *dev)
             C_SIZE_MULT = (csd[9] & 0x03);
             C_SIZE_MULT <<= 1;
             C_SIZE_MULT |= ((csd[10] >> 7) & 0x01);
+            ss = (C_SIZE + 1);
+            ss *= __SD_Power_Of_Two(C_SIZE_MULT + 2);
+            ss *= __SD_Power_Of_Two(READ_BL_LEN);
+            ss /= SD_BLK_SIZE;
         }
-        else if(dev->cardtype & SDCT_SD2)
-        {
-            // C_SIZE [69:48]
-            C_SIZE = (csd[7] & 0x3F);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[8] & 0xFF);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[9] & 0xFF);
-            // C_SIZE_MULT [--]. don't exits
-            C_SIZE_MULT = 0;
-        }
-        ss = (C_SIZE + 1);
-        ss *= __SD_Power_Of_Two(C_SIZE_MULT + 2);
-        ss *= __SD_Power_Of_Two(READ_BL_LEN);
-        ss /= SD_BLK_SIZE;
+#else
+        // Version 1.0 is only used by byte addressed cards
+        else ss = 0;
+#endif
         return (ss);
     } else return (0); // Error
 }
 
-/******************************************************************************
- Public Methods - Direct work with SD card
-******************************************************************************/
-
-SDRESULTS SD_Init(SD_DEV *dev)
+/**
+    \brief Read a single block, without retries.
+    \param dev Device descriptor.
+    \param dat Pointer to the destination object to put data.
+    \param sector Sector number.
+    \param ofs Byte offset in the sector (0..511).
+    \param cnt Byte count (1..512).
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Read_Block(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
 {
-    uint8_t n, cmd, ct, ocr[4];
-    uint8_t idx;
-    uint8_t init_trys;
-    ct = 0;
-    for(init_trys=0; ((init_trys!=SD_INIT_TRYS)&&(!ct)); init_trys++)
-    {
-        // Initialize SPI for use with the memory card
-        SPI_Init();
-
-        SPI_CS_High();
-        SPI_Freq_Low();
+    SDRESULTS res;
+    uint8_t tkn;
+    res = SD_ERROR;
+    if (__SD_Send_Cmd(CMD17, __SD_Addr(dev, sector)) == 0) {
+        tkn = __SD_Wait_Token();
+        // Token of single block?
+        if(tkn==0xFE) {
+            __SD_Crc_Start();
+            // Skip offset, receive the wanted bytes and skip the remaining
+            __SD_Rx_Bytes(0, ofs);
+            __SD_Rx_Bytes(dat, cnt);
+            __SD_Rx_Bytes(0, SD_BLK_SIZE - ofs - cnt);
+            res = __SD_Rx_End();
+        } else if(tkn==0xFF) res = SD_NORESPONSE;
+    }
+    __SD_Release();
+    return(res);
+}
 
-        // 80 dummy clocks
-        for(idx = 0; idx != 10; idx++) SPI_RW(0xFF);
+#if SD_IO_SDSC && SD_IO_PARTIAL_MAX
+/**
+    \brief Read a part of a block with a reduced block length.
+    \details Only for byte addressed cards with READ_BL_PARTIAL. The block
+    length is set to cnt (CMD16), the read starts at the byte address of the
+    first wanted byte and the length is restored to 512 bytes afterwards.
+    \param dev Device descriptor.
+    \param dat Pointer to the destination object to put data.
+    \param sector Sector number.
+    \param ofs Byte offset in the sector (0..511).
+    \param cnt Byte count (1..512).
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Read_Partial(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
+{
+    SDRESULTS res;
+    res = SD_ERROR;
+    if ((__SD_Send_Cmd(CMD16, cnt) == 0) &&
+        (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE + ofs) == 0))
+        res = __SD_Rx_Data(dat, cnt);
+    // Back to the full block length in any case
+    if (__SD_Send_Cmd(CMD16, SD_BLK_SIZE) != 0) res = SD_ERROR;
+    __SD_Release();
+    return(res);
+}
+#endif
 
-        SPI_Timer_On(500);
-        while(SPI_Timer_Status()==TRUE);
-        SPI_Timer_Off();
+/**
+    \brief Write a single block, without retries.
+    \param dev Device descriptor.
+    \param dat Data to write.
+    \param sector Sector number.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Write_Single(SD_DEV *dev, void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    res = SD_ERROR;
+    // Single block write (token <- 0xFE)
+    if(__SD_Send_Cmd(CMD24, __SD_Addr(dev, sector))==0)
+        res = __SD_Write_Block(dev, dat, 0xFE);
+    __SD_Release();
+    return(res);
+}
 
-        dev->mount = FALSE;
-        SPI_Timer_On(500);
-        while ((__SD_Send_Cmd(CMD0, 0) != 1)&&(SPI_Timer_Status()==TRUE));
-        SPI_Timer_Off();
-        // Idle state
-        if (__SD_Send_Cmd(CMD0, 0) == 1) {                      
-            // SD version 2?
-            if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) {
-                // Get trailing return value of R7 resp
-                for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
-                // VDD range of 2.7-3.6V is OK?  
-                if ((ocr[2] == 0x01)&&(ocr[3] == 0xAA))
-                {
-                    // Wait for leaving idle state (ACMD41 with HCS bit)...
-                    SPI_Timer_On(1000);
-                    while ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(ACMD41, 1UL << 30)));
-                    SPI_Timer_Off(); 
-                    // CCS in the OCR?
-                    if ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(CMD58, 0) == 0))
-                    {
-                        for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
-                        // SD version 2?
-                        ct = (ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
-                    }
-                }
-            } else {
-                // SD version 1 or MMC?
-                if (__SD_Send_Cmd(ACMD41, 0) <= 1)
-                {
-                    // SD version 1
-                    ct = SDCT_SD1; 
-                    cmd = ACMD41;
-                } else {
-                    // MMC version 3
-                    ct = SDCT_MMC; 
-                    cmd = CMD1;
-                }
-                // Wait for leaving idle state
-                SPI_Timer_On(250);
-                while((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(cmd, 0)));
-                SPI_Timer_Off();
-                if(SPI_Timer_Status()==FALSE) ct = 0;
-                if(__SD_Send_Cmd(CMD59, 0))   ct = 0;   // Deactivate CRC check (default)
-                if(__SD_Send_Cmd(CMD16, 512)) ct = 0;   // Set R/W block length to 512 bytes
-            }
-        }
+/**
+    \brief Read consecutive blocks with a single CMD18, without retries.
+    \param dev Device descriptor.
+    \param dat Pointer to the destination object to put data.
+    \param sector Start sector number.
+    \param count Number of sectors (1..).
+    \param done Returns the number of sectors received.
+    \param stop TRUE to stop at a block boundary when preempted.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Read_Multi(SD_DEV *dev, uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done, uint8_t stop)
+{
+    SDRESULTS res;
+    *done = 0;
+    res = SD_ERROR;
+    if (__SD_Send_Cmd(CMD18, __SD_Addr(dev, sector)) == 0) {
+        do {
+            res = __SD_Rx_Data(dat, SD_BLK_SIZE);
+            if(res != SD_OK) break;
+            dat += SD_BLK_SIZE;
+            (*done)++;
+#if SD_IO_ASYNC
+            if(stop && dev->preempt) break;
+#endif
+        } while(--count);
+        // Stop transmission, the card can be busy a while after it
+        if(__SD_Send_Cmd(CMD12, 0) & 0x80) res = SD_ERROR;
+        if(__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT)==FALSE) res = SD_BUSY;
     }
-    if(ct) {
-        dev->cardtype = ct;
-        dev->mount = TRUE;
-        dev->last_sector = __SD_Sectors(dev) - 1;
-        __SD_Speed_Transfer(HIGH); // High speed transfer
+    __SD_Release();
+    return(res);
+}
+
+/**
+    \brief Write consecutive blocks with a single CMD25, without retries.
+    \param dev Device descriptor.
+    \param dat Data to write.
+    \param sector Start sector number.
+    \param count Number of sectors (1..).
+    \param done Returns the number of sectors accepted by the card.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Write_Multi(SD_DEV *dev, const uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    SDRESULTS res;
+    *done = 0;
+    res = SD_ERROR;
+    // Let a SD card pre-erase the blocks that will be written
+    if(dev->cardtype & SDCT_SDC) __SD_Send_Cmd(ACMD23, count);
+    if(__SD_Send_Cmd(CMD25, __SD_Addr(dev, sector))==0) {
+        do {
+            // Multiple block write (token <- 0xFC)
+            res = __SD_Write_Block(dev, dat, 0xFC);
+            if(res != SD_OK) break;
+            dat += SD_BLK_SIZE;
+            (*done)++;
+        } while(--count);
+        // Stop token, waits until the end of programming
+        if((__SD_Write_Block(dev, 0, 0xFD) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
     }
-    SPI_Release();
-    return (ct ? SD_OK : SD_NOINIT);
+    __SD_Release();
+    return(res);
 }
 
-SDRESULTS SD_Read(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
+#if SD_IO_CACHE
+/**
+    \brief Look for a sector in the cache.
+    \return Cache line, NULL if the sector isn't cached.
+ */
+static SD_CLINE *__SD_Cache_Find(SD_DEV *dev, uint32_t sector)
+{
+    uint8_t idx;
+    for(idx=0; idx!=dev->lines; idx++)
+        if(dev->cache[idx].valid && (dev->cache[idx].sector == sector)) return(&dev->cache[idx]);
+    return(0);
+}
+
+/**
+    \brief Write dirty cache lines of consecutive sectors, without retries.
+    \details Each line is clean once the card accepts it.
+    \param sector Start sector number.
+    \param count Number of sectors (1..), all of them dirty in the cache.
+    \param done Returns the number of sectors accepted by the card.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Write_Lines(SD_DEV *dev, uint32_t sector, uint32_t count, uint32_t *done)
 {
     SDRESULTS res;
-    uint8_t tkn;
-    uint16_t remaining;
+    SD_CLINE *line;
+    uint8_t multi;
+    *done = 0;
     res = SD_ERROR;
-    if ((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
-    // Convert sector number to byte address (sector * SD_BLK_SIZE)
-    if (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE) == 0) {
-        SPI_Timer_On(100);  // Wait for data packet (timeout of 100ms)
+    multi = (count > 1) ? TRUE : FALSE;
+    if(multi && (dev->cardtype & SDCT_SDC)) __SD_Send_Cmd(ACMD23, count);
+    if(__SD_Send_Cmd(multi ? CMD25 : CMD24, __SD_Addr(dev, sector))==0) {
         do {
-            tkn = SPI_RW(0xFF);
-        } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
-        SPI_Timer_Off();
-        // Token of single block?
-        if(tkn==0xFE) { 
-            // Size block (512 bytes) + CRC (2 bytes) - offset - bytes to count
-            remaining = SD_BLK_SIZE + 2 - ofs - cnt;
-            // Skip offset
-            if(ofs) { 
-                do { 
-                    SPI_RW(0xFF); 
-                } while(--ofs);
-            }
-            // I receive the data and I write in user's buffer
-            do {
-                *(uint8_t*)dat = SPI_RW(0xFF);
-                dat++;
-            } while(--cnt);
-            // Skip remaining
-            do { 
-                SPI_RW(0xFF); 
-            } while (--remaining);
-            res = SD_OK;
-        }
+            line = __SD_Cache_Find(dev, sector + *done);
+            res = __SD_Write_Block(dev, line->dat, multi ? 0xFC : 0xFE);
+            if(res != SD_OK) break;
+            line->dirty = FALSE;
+            (*done)++;
+        } while(--count);
+        if(multi && (__SD_Write_Block(dev, 0, 0xFD) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
     }
-    SPI_Release();
+    __SD_Release();
     return(res);
 }
 
-SDRESULTS SD_Write(SD_DEV *dev, void *dat, uint32_t sector)
+/**
+    \brief Write back the dirty cache lines of a range of sectors.
+    \details Runs of consecutive dirty sectors go out with a single CMD25;
+    a run started in the range is written to its end.
+    \param first First sector of the range.
+    \param count Number of sectors.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Cache_Flush(SD_DEV *dev, uint32_t first, uint32_t count)
 {
-    // Query ok?
-    if(sector > dev->last_sector) return(SD_PARERR);
-    // Single block write (token <- 0xFE)
-    // Convert sector number to bytes address (sector * SD_BLK_SIZE)
-    if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)==0)
-        return(__SD_Write_Block(dev, dat, 0xFE));
-    else
-        return(SD_ERROR);
+    SDRESULTS res;
+    SD_CLINE *line;
+    uint32_t sector, n, done;
+    uint8_t idx, trys;
+    for(;;) {
+        // Lowest dirty sector of the range
+        line = 0;
+        for(idx=0; idx!=dev->lines; idx++) {
+            if(!dev->cache[idx].valid || !dev->cache[idx].dirty) continue;
+            if(dev->cache[idx].sector - first >= count) continue;
+            if(!line || (dev->cache[idx].sector < line->sector)) line = &dev->cache[idx];
+        }
+        if(!line) return(SD_OK);
+        sector = line->sector;
+        for(n = 1; (line = __SD_Cache_Find(dev, sector + n)) && line->dirty; n++);
+        trys = 0;
+        do {
+            res = __SD_Write_Lines(dev, sector, n, &done);
+            sector += done;
+            n -= done;
+            if(done) trys = 0;
+        } while(n && __SD_Retry(dev, res, trys++));
+        if(res != SD_OK) return(res);
+    }
 }
 
-inline SDRESULTS SD_Status(void)
+/**
+    \brief Take a cache line for a sector (round robin replacement).
+    \details A dirty line is written back before it is replaced.
+    \param line Returns the cache line, not valid until the caller fills it.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Cache_Alloc(SD_DEV *dev, uint32_t sector, SD_CLINE **line)
 {
-    return(__SD_Send_Cmd(CMD0, 0) ? SD_OK : SD_NORESPONSE);
+    SDRESULTS res;
+    SD_CLINE *l;
+    l = &dev->cache[dev->victim];
+    if(l->valid && l->dirty) {
+        res = __SD_Cache_Flush(dev, l->sector, 1);
+        if(res != SD_OK) return(res);
+    }
+    if(++dev->victim == dev->lines) dev->victim = 0;
+    l->valid = FALSE;
+    l->dirty = FALSE;
+    l->sector = sector;
+    *line = l;
+    return(SD_OK);
+}
+
+/**
+    \brief Drop the cached copies of a range of sectors.
+    \param first First sector of the range.
+    \param count Number of sectors.
+ */
+static void __SD_Cache_Drop(SD_DEV *dev, uint32_t first, uint32_t count)
+{
+    uint8_t idx;
+    for(idx=0; idx!=dev->lines; idx++)
+        if(dev->cache[idx].sector - first < count) dev->cache[idx].valid = FALSE;
+}
+#endif
+
+#if SD_IO_SKIP
+/**
+    \brief FNV-1a hash of a sector.
+ */
+static uint32_t __SD_Hash(const uint8_t *dat)
+{
+    uint32_t h = 2166136261UL;
+    uint16_t idx;
+    for(idx=0; idx!=SD_BLK_SIZE; idx++) h = (h ^ dat[idx]) * 16777619UL;
+    return(h);
+}
+
+/**
+    \brief Look for the hash entry of a sector.
+    \return Entry, NULL if the sector has none.
+ */
+static SD_SHASH *__SD_Hash_Find(SD_DEV *dev, uint32_t sector)
+{
+    uint8_t idx;
+    for(idx=0; idx!=dev->nhash; idx++)
+        if(dev->hashes[idx].hash && (dev->hashes[idx].sector == sector)) return(&dev->hashes[idx]);
+    return(0);
+}
+
+/**
+    \brief Keep the hash of a sector just written (round robin replacement).
+ */
+static void __SD_Hash_Set(SD_DEV *dev, uint32_t sector, uint32_t hash)
+{
+    SD_SHASH *e;
+    if(!dev->nhash) return;
+    e = __SD_Hash_Find(dev, sector);
+    if(!e) {
+        e = &dev->hashes[dev->hvictim];
+        if(++dev->hvictim == dev->nhash) dev->hvictim = 0;
+        e->sector = sector;
+    }
+    e->hash = hash;
+}
+
+/**
+    \brief Drop the hashes of a range of sectors.
+    \param first First sector of the range.
+    \param count Number of sectors.
+ */
+static void __SD_Hash_Drop(SD_DEV *dev, uint32_t first, uint32_t count)
+{
+    uint8_t idx;
+    for(idx=0; idx!=dev->nhash; idx++)
+        if(dev->hashes[idx].sector - first < count) dev->hashes[idx].hash = 0;
+}
+#endif
+
+#if SD_IO_ERASED
+/**
+    \brief Look for an erased range holding a run of sectors.
+    \return TRUE if all the sectors are erased.
+ */
+static uint8_t __SD_Erased_Has(SD_DEV *dev, uint32_t sector, uint32_t count)
+{
+    uint8_t idx;
+    SD_ERANGE *r;
+    for(idx=0; idx!=dev->eused; idx++) {
+        r = &dev->erased[idx];
+        if((sector - r->first < r->count) && (count <= r->count - (sector - r->first))) return(TRUE);
+    }
+    return(FALSE);
+}
+
+/**
+    \brief Add the range first..last (inclusive), merged with the ranges it
+    overlaps or touches. When the map is full the shortest range is lost.
+ */
+static void __SD_Erased_Add(SD_DEV *dev, uint32_t first, uint32_t last)
+{
+    uint8_t idx, min;
+    SD_ERANGE *r;
+    uint32_t end;
+    idx = 0;
+    while(idx < dev->eused) {
+        r = &dev->erased[idx];
+        end = r->first + r->count - 1;
+        if(((r->first > last) && (r->first - last > 1)) || ((first > end) && (first - end > 1))) {
+            idx++;
+            continue;
+        }
+        // Absorb it, its slot takes the last entry
+        if(r->first < first) first = r->first;
+        if(end > last) last = end;
+        *r = dev->erased[--dev->eused];
+    }
+    if(dev->eused < dev->nerased) idx = dev->eused++;
+    else {
+        for(min=0, idx=1; idx<dev->nerased; idx++)
+            if(dev->erased[idx].count < dev->erased[min].count) min = idx;
+        if(dev->erased[min].count > last - first) return;
+        idx = min;
+    }
+    dev->erased[idx].first = first;
+    dev->erased[idx].count = last - first + 1;
+}
+
+/**
+    \brief Take a run of sectors out of the erased ranges.
+    \param first First sector of the run.
+    \param count Number of sectors.
+ */
+static void __SD_Erased_Drop(SD_DEV *dev, uint32_t first, uint32_t count)
+{
+    uint8_t idx;
+    SD_ERANGE *r;
+    uint32_t end, last;
+    last = first + count - 1;
+    idx = 0;
+    while(idx < dev->eused) {
+        r = &dev->erased[idx];
+        end = r->first + r->count - 1;
+        if((end < first) || (r->first > last)) {
+            idx++;
+            continue;
+        }
+        if((r->first < first) && (end > last)) {
+            // Split; without a free entry the shorter piece is lost
+            r->count = first - r->first;
+            if(dev->eused < dev->nerased) {
+                dev->erased[dev->eused].first = last + 1;
+                dev->erased[dev->eused++].count = end - last;
+            } else if(end - last > r->count) {
+                r->first = last + 1;
+                r->count = end - last;
+            }
+        } else if(r->first < first) r->count = first - r->first;
+        else if(end > last) {
+            r->first = last + 1;
+            r->count = end - last;
+        } else {
+            *r = dev->erased[--dev->eused];
+            continue;
+        }
+        idx++;
+    }
+}
+#endif
+
+/**
+    \brief Total length of a list of segments.
+    \return Bytes.
+ */
+static uint32_t __SD_Iov_Len(const SD_IOVEC *iov, uint8_t iovcnt)
+{
+    uint32_t len;
+    len = 0;
+    while(iovcnt--) len += (iov++)->len;
+    return(len);
+}
+
+/**
+    \brief Place a cursor at a byte of a list of segments.
+    \param cur Cursor.
+    \param pos Byte position from the start of the first segment.
+ */
+static void __SD_Iov_Seek(SD_IOCUR *cur, const SD_IOVEC *iov, uint8_t iovcnt, uint32_t pos)
+{
+    while(iovcnt && (pos >= iov->len)) {
+        pos -= iov->len;
+        iov++;
+        iovcnt--;
+    }
+    cur->iov = iov;
+    cur->left = iovcnt;
+    cur->ofs = (uint16_t)pos;
+}
+
+/**
+    \brief Send or receive a block through a cursor.
+    \details Bytes received past the last segment are dropped; the cursor
+    never runs out when sending, because writes are whole blocks.
+    \param cur Cursor, left after the block.
+    \param rx TRUE to receive, FALSE to send.
+ */
+static void __SD_Iov_Block(SD_IOCUR *cur, uint8_t rx)
+{
+    uint16_t cnt, n;
+    uint8_t *p;
+    cnt = SD_BLK_SIZE;
+    while(cnt && cur->left) {
+        n = cur->iov->len - cur->ofs;
+        if(n > cnt) n = cnt;
+        p = (uint8_t*)cur->iov->buf;
+        // NULL segments are skipped bytes or padding
+        if(p) p += cur->ofs;
+        if(rx) __SD_Rx_Bytes(p, n);
+        else __SD_Tx_Bytes(p, n);
+        cnt -= n;
+        cur->ofs += n;
+        if(cur->ofs == cur->iov->len) {
+            cur->iov++;
+            cur->left--;
+            cur->ofs = 0;
+        }
+    }
+    if(rx) __SD_Rx_Bytes(0, cnt);
+    else __SD_Tx_Bytes(0, cnt);
+}
+
+/**
+    \brief Vectored read without retries.
+    \param cur Cursor at the data of the start sector.
+    \param sector Start sector number.
+    \param count Number of sectors (1..).
+    \param done Returns the number of sectors received.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Readv_Multi(SD_DEV *dev, SD_IOCUR *cur, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    SDRESULTS res;
+    uint8_t tkn, multi;
+    *done = 0;
+    res = SD_ERROR;
+    multi = (count > 1) ? TRUE : FALSE;
+    if (__SD_Send_Cmd(multi ? CMD18 : CMD17, __SD_Addr(dev, sector)) == 0) {
+        do {
+            tkn = __SD_Wait_Token();
+            if(tkn != 0xFE) {
+                res = (tkn == 0xFF) ? SD_NORESPONSE : SD_ERROR;
+                break;
+            }
+            __SD_Crc_Start();
+            __SD_Iov_Block(cur, TRUE);
+            res = __SD_Rx_End();
+            if(res != SD_OK) break;
+            (*done)++;
+        } while(--count);
+        if(multi) {
+            if(__SD_Send_Cmd(CMD12, 0) & 0x80) res = SD_ERROR;
+            if(__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT)==FALSE) res = SD_BUSY;
+        }
+    }
+    __SD_Release();
+    return(res);
+}
+
+/**
+    \brief Vectored write without retries.
+    \param cur Cursor at the data of the start sector.
+    \param sector Start sector number.
+    \param count Number of sectors (1..).
+    \param done Returns the number of sectors accepted by the card.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Writev_Multi(SD_DEV *dev, SD_IOCUR *cur, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    SDRESULTS res;
+    uint8_t multi;
+    *done = 0;
+    res = SD_ERROR;
+    multi = (count > 1) ? TRUE : FALSE;
+    if(multi && (dev->cardtype & SDCT_SDC)) __SD_Send_Cmd(ACMD23, count);
+    if(__SD_Send_Cmd(multi ? CMD25 : CMD24, __SD_Addr(dev, sector))==0) {
+        do {
+            SD_PROBE_BEGIN(SD_PH_TOKEN);
+            SPI_RW(multi ? 0xFC : 0xFE);
+            SD_PROBE_END(SD_PH_TOKEN);
+            __SD_Crc_Start();
+            __SD_Iov_Block(cur, FALSE);
+            res = __SD_Tx_End();
+            if(res != SD_OK) break;
+            (*done)++;
+        } while(--count);
+        if(multi && (__SD_Write_Block(dev, 0, 0xFD) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
+    }
+    __SD_Release();
+    return(res);
+}
+
+/**
+    \brief Bring the card back to transfer state after a failed operation.
+    \details First a CMD12 aborts any transfer left open and a CMD13 reads
+    (and clears) the card status. Only when the card doesn't answer or has
+    fallen back to idle state the recovery escalates to a full SD_Init.
+    \param dev Device descriptor.
+    \return SD_OK if the operation can be retried.
+ */
+static SDRESULTS __SD_Recover(SD_DEV *dev)
+{
+    uint8_t r1;
+    // Stop transmission (harmless if there isn't one in progress)
+    __SD_Count(dev, stops);
+    __SD_Assert();
+    __SD_Send_Cmd(CMD12, 0);
+    __SD_Release();
+    // Read the status; the second byte of R2 isn't needed
+    __SD_Count(dev, status);
+    r1 = __SD_Send_Cmd(CMD13, 0);
+    SPI_RW(0xFF);
+    __SD_Release();
+    // Card answers and it is out of idle state?
+    if(!(r1 & 0x81)) return(SD_OK);
+#if SD_IO_RETRY_REINIT
+    __SD_Count(dev, reinits);
+    return(__SD_Init(dev));
+#else
+    return(SD_NORESPONSE);
+#endif
+}
+
+/**
+    \brief Decide if a failed operation must be retried.
+    \param dev Device descriptor.
+    \param res Result of the last attempt.
+    \param trys Attempts already retried.
+    \return TRUE if the card was recovered and the operation must be repeated.
+ */
+static uint8_t __SD_Retry(SD_DEV *dev, SDRESULTS res, uint8_t trys)
+{
+    if(res == SD_OK) return(FALSE);
+    if(trys != SD_IO_RETRYS)
+    {
+        __SD_Count(dev, retries);
+        if(__SD_Recover(dev) == SD_OK) return(TRUE);
+    }
+    __SD_Count(dev, failures);
+    return(FALSE);
+}
+
+/**
+    \brief Power up sequence of the SPI bus: clocks at low speed.
+    \param dev Devices powered up together.
+    \param n Number of devices.
+    \param ms Time for the cards to settle after the dummy clocks.
+ */
+static void __SD_Power_Up(SD_DEV *dev, uint8_t n, uint16_t ms)
+{
+    uint8_t idx;
+    // Initialize SPI for use with the memory card
+    SPI_Init();
+
+    // Every card deselected
+    for(idx = 0; idx != n; idx++) {
+#if SD_IO_CARDS > 1
+        SPI_CS_Sel(dev[idx].cs);
+        __SD_Cs = dev[idx].cs;
+#endif
+        SPI_CS_High();
+    }
+    SPI_Freq_Low();
+
+    // 80 dummy clocks
+    for(idx = 0; idx != 10; idx++) SPI_RW(0xFF);
+
+    SPI_Timer_On(ms);
+    while(SPI_Timer_Status()==TRUE);
+    SPI_Timer_Off();
+}
+
+#if SD_IO_MMC && SD_IO_MMC_HS
+/**
+    \brief Switch a MMCv4 card to high speed timing and raise the clock.
+    \details MMCv3 cards (CMD8 rejected) and cards without a high speed in
+    CARD_TYPE keep the SPI_Freq_High clock.
+ */
+static void __SD_Mmc_Speed(void)
+{
+    uint8_t type;
+    uint32_t sec;
+    if((__SD_Read_Ext_Csd(&type, &sec) == SD_OK) && (type & 0x03)) {
+        // SWITCH, write byte: HS_TIMING [185] = 1, busy until done
+        if((__SD_Send_Cmd(CMD6, (3UL << 24) | (185UL << 16) | (1UL << 8)) == 0) &&
+           (__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT) == TRUE))
+            SPI_Freq_Card((type & 0x02) ? 52 : 26);
+        __SD_Release();
+    }
+}
+#endif
+
+/**
+    \brief Read the OCR of a card out of idle state (CMD58).
+    \param ct Card type, 0 if the card failed.
+    \return Card type with SDCT_BLOCK when CCS (SD) or the sector access
+    mode (MMC) is set, 0 if the OCR can't be read or the card is byte
+    addressed and SD_IO_SDSC is off.
+ */
+static uint8_t __SD_Ocr(uint8_t ct)
+{
+    uint8_t n, ocr[4];
+    if (!ct || __SD_Send_Cmd(CMD58, 0)) return(0);
+    for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
+    if (ocr[0] & 0x40) return(ct | SDCT_BLOCK);
+#if SD_IO_SDSC
+    return(ct);
+#else
+    // Byte addressed cards aren't supported
+    return(0);
+#endif
+}
+
+/**
+    \brief Last commands for a card out of idle state: block length and CRC.
+    \param ct Card type, 0 if the card failed.
+    \return Card type, 0 if a command failed.
+ */
+static uint8_t __SD_Init_Finish(uint8_t ct)
+{
+#if SD_IO_SD1 || SD_IO_MMC
+    if(ct & (SDCT_SD1|SDCT_MMC)) {
+#if !SD_IO_CRC
+        if(__SD_Send_Cmd(CMD59, 0))   ct = 0;   // Deactivate CRC check (default)
+#endif
+        // Set R/W block length to 512 bytes, fixed in sector mode
+        if(!(ct & SDCT_BLOCK) && __SD_Send_Cmd(CMD16, 512)) ct = 0;
+    }
+#endif
+#if SD_IO_CRC
+    // Activate CRC check of commands and data
+    if(ct && __SD_Send_Cmd(CMD59, 1)) ct = 0;
+#endif
+    return(ct);
+}
+
+/**
+    \brief Read the capacity and mount an initialized card.
+    \param ct Card type, 0 if the card failed.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Init_Mount(SD_DEV *dev, uint8_t ct)
+{
+    if(ct) {
+        dev->cardtype = ct;
+        dev->last_sector = __SD_Sectors(dev) - 1;
+        // A card without a readable CSD is no use
+        if(dev->last_sector == (uint32_t)-1) ct = 0;
+    }
+    if(ct) {
+        dev->mount = TRUE;
+        __SD_Speed_Transfer(HIGH); // High speed transfer
+#if SD_IO_MMC && SD_IO_MMC_HS
+        if(ct & SDCT_MMC) __SD_Mmc_Speed();
+#endif
+    }
+    __SD_Release();
+    return (ct ? SD_OK : SD_NOINIT);
+}
+
+/**
+    \brief Initialization the SD card, keeping the sector cache.
+    \param dev Device descriptor.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SD_Init(SD_DEV *dev)
+{
+    uint8_t n, ct, ocr[4];
+#if SD_IO_SD1 || SD_IO_MMC
+    uint8_t cmd;
+#endif
+    uint8_t init_trys;
+    ct = 0;
+    for(init_trys=0; ((init_trys!=SD_INIT_TRYS)&&(!ct)); init_trys++)
+    {
+        __SD_Power_Up(dev, 1, SD_IO_POWERUP_WAIT);
+
+        dev->mount = FALSE;
+        dev->xfer = FALSE;
+        SPI_Timer_On(SD_IO_IDLE_TIMEOUT_WAIT);
+        while ((__SD_Send_Cmd(CMD0, 0) != 1)&&(SPI_Timer_Status()==TRUE));
+        SPI_Timer_Off();
+        // Idle state
+        if (__SD_Send_Cmd(CMD0, 0) == 1) {                      
+            // SD version 2?
+            if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) {
+                // Get trailing return value of R7 resp
+                for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
+                // VDD range of 2.7-3.6V is OK?  
+                if ((ocr[2] == 0x01)&&(ocr[3] == 0xAA))
+                {
+                    // Wait for leaving idle state (ACMD41 with HCS bit)...
+                    SPI_Timer_On(SD_IO_INIT_TIMEOUT_WAIT);
+                    while ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(ACMD41, 1UL << 30)));
+                    SPI_Timer_Off(); 
+                    // SD version 2, CCS in the OCR?
+                    if (SPI_Timer_Status()==TRUE) ct = __SD_Ocr(SDCT_SD2);
+                }
+            }
+#if SD_IO_SD1 || SD_IO_MMC
+            else {
+#if SD_IO_SD1 && SD_IO_MMC
+                // SD version 1 or MMC?
+                if (__SD_Send_Cmd(ACMD41, 0) <= 1)
+                {
+                    // SD version 1
+                    ct = SDCT_SD1; 
+                    cmd = ACMD41;
+                } else {
+                    // MMC
+                    ct = SDCT_MMC; 
+                    cmd = CMD1;
+                }
+#elif SD_IO_SD1
+                ct = SDCT_SD1;
+                cmd = ACMD41;
+#else
+                ct = SDCT_MMC;
+                cmd = CMD1;
+#endif
+                // Wait for leaving idle state, MMC offered the sector mode
+                SPI_Timer_On(SD_IO_INIT_V1_TIMEOUT_WAIT);
+                while((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(cmd, (cmd == CMD1) ? SD_MMC_OCR : 0)));
+                SPI_Timer_Off();
+                if(SPI_Timer_Status()==FALSE) ct = 0;
+#if SD_IO_MMC
+                // Sector mode (MMCv4 above 2 GB) accepted?
+                else if(ct & SDCT_MMC) ct = __SD_Ocr(ct);
+#endif
+            }
+#endif
+            ct = __SD_Init_Finish(ct);
+        }
+    }
+    return(__SD_Init_Mount(dev, ct));
+}
+
+/**
+    \brief Detach the tables of a device before a full initialization.
+ */
+static void __SD_Dev_Reset(SD_DEV *dev)
+{
+#if SD_IO_CACHE
+    dev->cache = 0;
+    dev->lines = 0;
+#endif
+#if SD_IO_SKIP
+    dev->hashes = 0;
+    dev->nhash = 0;
+#endif
+#if SD_IO_ERASED
+    dev->erased = 0;
+    dev->nerased = 0;
+    dev->eused = 0;
+#endif
+#if SD_IO_ASYNC
+    dev->preempt = FALSE;
+#endif
+    dev->cardtype = 0;
+}
+
+/******************************************************************************
+ Public Methods - Direct work with SD card
+******************************************************************************/
+
+SDRESULTS SD_Init(SD_DEV *dev)
+{
+    __SD_Select(dev);
+    __SD_Dev_Reset(dev);
+    return(__SD_Init(dev));
+}
+
+SDRESULTS SD_Remount(SD_DEV *dev)
+{
+    uint8_t n, ct, ok, cmd;
+    uint32_t arg;
+    __SD_Select(dev);
+    ct = dev->cardtype;
+    // Never identified: nothing to take a shortcut with
+    if (!ct) return(__SD_Init(dev));
+    __SD_Power_Up(dev, 1, SD_IO_REMOUNT_WAIT);
+    dev->mount = FALSE;
+    dev->xfer = FALSE;
+    ok = FALSE;
+    SPI_Timer_On(SD_IO_IDLE_TIMEOUT_WAIT);
+    while ((__SD_Send_Cmd(CMD0, 0) != 1)&&(SPI_Timer_Status()==TRUE));
+    ok = SPI_Timer_Status();
+    SPI_Timer_Off();
+    if (ok == TRUE) {
+        // Same type as before: no CSD, no OCR and no probing of versions
+        cmd = ACMD41;
+        arg = 0;
+        if (ct & SDCT_SD2) {
+            // SDv2 needs CMD8 before ACMD41 with HCS
+            if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) for (n = 0; n < 4; n++) SPI_RW(0xFF);
+            arg = 1UL << 30;
+        }
+#if SD_IO_MMC
+        else if (ct & SDCT_MMC) {
+            cmd = CMD1;
+            arg = SD_MMC_OCR;
+        }
+#endif
+        SPI_Timer_On(SD_IO_INIT_TIMEOUT_WAIT);
+        while ((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(cmd, arg)));
+        ok = SPI_Timer_Status();
+        SPI_Timer_Off();
+        if ((ok == TRUE) && !(ct & SDCT_BLOCK) && __SD_Send_Cmd(CMD16, 512)) ok = FALSE;
+#if SD_IO_CRC
+        if ((ok == TRUE) && __SD_Send_Cmd(CMD59, 1)) ok = FALSE;
+#endif
+    }
+    __SD_Release();
+    // Not the same card anymore? Full initialization
+    if (ok != TRUE) {
+        __SD_Count(dev, reinits);
+        return(__SD_Init(dev));
+    }
+    dev->mount = TRUE;
+    __SD_Speed_Transfer(HIGH);
+#if SD_IO_MMC && SD_IO_MMC_HS
+    // The power cycle went back to the default timing
+    if(ct & SDCT_MMC) __SD_Mmc_Speed();
+#endif
+    return(SD_OK);
+}
+
+#if SD_IO_CARDS > 1
+SDRESULTS SD_Init_All(SD_DEV *dev, uint8_t n)
+{
+    uint8_t st[SD_IO_CARDS], cmd[SD_IO_CARDS], ct[SD_IO_CARDS], ocr[4];
+    uint8_t idx, k, left;
+    SDRESULTS res;
+    if ((n == 0)||(n > SD_IO_CARDS)) return(SD_PARERR);
+    for (idx = 0; idx != n; idx++) {
+        __SD_Dev_Reset(&dev[idx]);
+        dev[idx].mount = FALSE;
+        dev[idx].xfer = FALSE;
+        st[idx] = 0;
+        ct[idx] = 0;
+    }
+    // One power up wait for every card
+    __SD_Power_Up(dev, n, SD_IO_POWERUP_WAIT);
+    // Idle state (st 1), round robin
+    SPI_Timer_On(SD_IO_IDLE_TIMEOUT_WAIT);
+    do {
+        left = 0;
+        for (idx = 0; idx != n; idx++) {
+            if (st[idx] != 0) continue;
+            __SD_Select(&dev[idx]);
+            if (__SD_Send_Cmd(CMD0, 0) == 1) st[idx] = 1;
+            else left++;
+        }
+    } while (left && (SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    // Version of each card, then the leaving of idle state polled (st 2)
+    for (idx = 0; idx != n; idx++) {
+        if (st[idx] != 1) continue;
+        __SD_Select(&dev[idx]);
+        cmd[idx] = ACMD41;
+        if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) {
+            for (k = 0; k < 4; k++) ocr[k] = SPI_RW(0xFF);
+            if ((ocr[2] == 0x01)&&(ocr[3] == 0xAA)) {
+                ct[idx] = SDCT_SD2;
+                st[idx] = 2;
+            }
+        }
+#if SD_IO_SD1 || SD_IO_MMC
+        else {
+#if SD_IO_SD1 && SD_IO_MMC
+            if (__SD_Send_Cmd(ACMD41, 0) <= 1) ct[idx] = SDCT_SD1;
+            else {
+                ct[idx] = SDCT_MMC;
+                cmd[idx] = CMD1;
+            }
+#elif SD_IO_SD1
+            ct[idx] = SDCT_SD1;
+#else
+            ct[idx] = SDCT_MMC;
+            cmd[idx] = CMD1;
+#endif
+            st[idx] = 2;
+        }
+#endif
+    }
+    SPI_Timer_On(SD_IO_INIT_TIMEOUT_WAIT);
+    do {
+        left = 0;
+        for (idx = 0; idx != n; idx++) {
+            if (st[idx] != 2) continue;
+            __SD_Select(&dev[idx]);
+            if (__SD_Send_Cmd(cmd[idx], (ct[idx] & SDCT_SD2) ? 1UL << 30 : (cmd[idx] == CMD1) ? SD_MMC_OCR : 0) == 0) st[idx] = 3;
+            else left++;
+        }
+    } while (left && (SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    // Ready cards (st 3) are finished one by one, the others start over alone
+    res = SD_OK;
+    for (idx = 0; idx != n; idx++) {
+        __SD_Select(&dev[idx]);
+        if (st[idx] == 3) {
+            // CCS or sector mode in the OCR?
+            if (ct[idx] & (SDCT_SD2|SDCT_MMC)) ct[idx] = __SD_Ocr(ct[idx]);
+            ct[idx] = __SD_Init_Finish(ct[idx]);
+            if (__SD_Init_Mount(&dev[idx], ct[idx]) == SD_OK) continue;
+        }
+        __SD_Release();
+        if (__SD_Init(&dev[idx]) != SD_OK) res = SD_NOINIT;
+    }
+    // A card that failed alone left the clock low
+    for (idx = 0; idx != n; idx++) if (dev[idx].mount) __SD_Speed_Transfer(HIGH);
+    return(res);
+}
+#endif
+
+#if SD_IO_CACHE
+SDRESULTS SD_Cache(SD_DEV *dev, SD_CLINE *lines, uint8_t n)
+{
+    SDRESULTS res;
+    uint8_t idx;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    // Nothing written with SD_Write_Bytes is left behind
+    res = __SD_Cache_Flush(dev, 0, (uint32_t)-1);
+    if (res != SD_OK) return(res);
+    if (!lines) n = 0;
+    for(idx=0; idx!=n; idx++) lines[idx].valid = FALSE;
+    dev->cache = lines;
+    dev->lines = n;
+    dev->victim = 0;
+    return(SD_OK);
+}
+#endif
+
+#if SD_IO_SKIP
+SDRESULTS SD_Skip(SD_DEV *dev, SD_SHASH *tab, uint8_t n)
+{
+    uint8_t idx;
+    if (!dev->mount) return(SD_NOINIT);
+    if (!tab) n = 0;
+    for(idx=0; idx!=n; idx++) tab[idx].hash = 0;
+    dev->hashes = tab;
+    dev->nhash = n;
+    dev->hvictim = 0;
+    return(SD_OK);
+}
+#endif
+
+#if SD_IO_ERASED
+SDRESULTS SD_Erased(SD_DEV *dev, SD_ERANGE *map, uint8_t n)
+{
+    SDRESULTS res;
+    uint8_t scr[8];
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    dev->erased = 0;
+    dev->nerased = 0;
+    dev->eused = 0;
+    if (!map) return(SD_OK);
+#if SD_IO_MMC
+    if (dev->cardtype & SDCT_MMC) return(SD_REJECT);
+#endif
+    // DATA_STAT_AFTER_ERASE[55] of the SCR
+    res = SD_ERROR;
+    if (__SD_Send_Cmd(ACMD51, 0) == 0) res = __SD_Rx_Data(scr, 8);
+    __SD_Release();
+    if (res != SD_OK) return(res);
+    dev->erase_val = (scr[1] & 0x80) ? 0xFF : 0x00;
+    dev->erased = map;
+    dev->nerased = n;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Erased_Mark(SD_DEV *dev, uint32_t first, uint32_t count)
+{
+    if (!dev->mount) return(SD_NOINIT);
+    if ((count == 0)||(first > dev->last_sector)||(count - 1 > dev->last_sector - first)) return(SD_PARERR);
+    if (dev->nerased) __SD_Erased_Add(dev, first, first + count - 1);
+    return(SD_OK);
+}
+#endif
+
+SDRESULTS SD_Read(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
+{
+    SDRESULTS res;
+    uint8_t trys;
+#if SD_IO_CACHE
+    SD_CLINE *line;
+#endif
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if ((sector > dev->last_sector)||(cnt == 0)||(ofs + cnt > SD_BLK_SIZE)) return(SD_PARERR);
+#if SD_IO_CACHE
+    line = __SD_Cache_Find(dev, sector);
+    if (line) {
+        memcpy(dat, line->dat + ofs, cnt);
+        return(SD_OK);
+    }
+#endif
+#if SD_IO_ERASED
+    if (__SD_Erased_Has(dev, sector, 1)) {
+        memset(dat, dev->erase_val, cnt);
+        return(SD_OK);
+    }
+#endif
+    trys = 0;
+    do {
+#if SD_IO_SDSC && SD_IO_PARTIAL_MAX
+        // Short read on a card that allows partial blocks?
+        if ((dev->cardtype & (SDCT_RDPART|SDCT_BLOCK)) == SDCT_RDPART && cnt <= SD_IO_PARTIAL_MAX)
+            res = __SD_Read_Partial(dev, dat, sector, ofs, cnt);
+        else
+#endif
+            res = __SD_Read_Block(dev, dat, sector, ofs, cnt);
+    } while(__SD_Retry(dev, res, trys++));
+    return(res);
+}
+
+SDRESULTS SD_Write(SD_DEV *dev, void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    uint8_t trys;
+#if SD_IO_CACHE
+    SD_CLINE *line;
+#endif
+#if SD_IO_SKIP
+    SD_SHASH *e;
+    uint32_t h;
+#endif
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    // Query ok?
+    if(sector > dev->last_sector) return(SD_PARERR);
+#if SD_IO_SKIP
+    // Same content as the card already has?
+#if SD_IO_CACHE
+    line = __SD_Cache_Find(dev, sector);
+    if (line && !memcmp(line->dat, dat, SD_BLK_SIZE)) {
+        __SD_Count(dev, skips);
+        return(SD_OK);
+    }
+#endif
+    h = 0;
+    if (dev->nhash) {
+        h = __SD_Hash(dat);
+        e = __SD_Hash_Find(dev, sector);
+        if (e && (e->hash == h)) {
+            __SD_Count(dev, skips);
+            return(SD_OK);
+        }
+    }
+#endif
+#if SD_IO_ERASED
+    __SD_Erased_Drop(dev, sector, 1);
+#endif
+    trys = 0;
+    do {
+        res = __SD_Write_Single(dev, dat, sector);
+    } while(__SD_Retry(dev, res, trys++));
+#if SD_IO_CACHE
+    // Write-through: keep a cached copy up to date
+    line = __SD_Cache_Find(dev, sector);
+    if (line) {
+        if (res == SD_OK) memcpy(line->dat, dat, SD_BLK_SIZE);
+        else line->valid = FALSE;
+        line->dirty = FALSE;
+    }
+#endif
+#if SD_IO_SKIP
+    if (res == SD_OK) {
+        if (h) __SD_Hash_Set(dev, sector, h);
+    } else __SD_Hash_Drop(dev, sector, 1);
+#endif
+    return(res);
+}
+
+SDRESULTS SD_Read_Bytes(SD_DEV *dev, uint64_t addr, void *dat, uint32_t len)
+{
+    SDRESULTS res;
+    SD_IOVEC iov[2];
+    uint32_t sector, run, cnt;
+    uint16_t ofs, n;
+    uint8_t *p = (uint8_t *)dat;
+#if SD_IO_CACHE
+    SD_CLINE *line;
+#endif
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if ((len == 0)||((addr + len - 1) / SD_BLK_SIZE > dev->last_sector)) return(SD_PARERR);
+    sector = (uint32_t)(addr / SD_BLK_SIZE);
+    ofs = (uint16_t)(addr % SD_BLK_SIZE);
+    do {
+        // Bytes wanted from this sector
+        n = SD_BLK_SIZE - ofs;
+        if (n > len) n = len;
+#if SD_IO_CACHE
+        line = __SD_Cache_Find(dev, sector);
+        // Keep the last sector read in part, the next read likely goes on there
+        if (!line && dev->lines && (n == len) && (ofs + n != SD_BLK_SIZE)) {
+            res = __SD_Cache_Alloc(dev, sector, &line);
+            if (res != SD_OK) return(res);
+            res = SD_Read(dev, line->dat, sector, 0, SD_BLK_SIZE);
+            if (res != SD_OK) return(res);
+            line->valid = TRUE;
+        }
+        if (line) {
+            memcpy(p, line->dat + ofs, n);
+            p += n;
+            len -= n;
+            sector++;
+            ofs = 0;
+            continue;
+        }
+#endif
+        // Run of consecutive sectors out of the cache
+        run = n;
+        cnt = 1;
+        while ((run < len)&&(cnt < SD_IO_BYTES_RUN)) {
+#if SD_IO_CACHE
+            if (__SD_Cache_Find(dev, sector + cnt)) break;
+#endif
+            run += (len - run > SD_BLK_SIZE) ? SD_BLK_SIZE : len - run;
+            cnt++;
+        }
+        if (cnt == 1) {
+            res = SD_Read(dev, p, sector, ofs, n);
+        } else {
+            // Skip the bytes before the address, the tail is skipped by Readv
+            iov[0].buf = 0;
+            iov[0].len = ofs;
+            iov[1].buf = p;
+            iov[1].len = (uint16_t)run;
+            res = SD_Readv(dev, iov, 2, sector);
+        }
+        if (res != SD_OK) return(res);
+        p += run;
+        len -= run;
+        sector += cnt;
+        ofs = 0;
+    } while (len);
+    return(SD_OK);
+}
+
+#if SD_IO_CACHE
+SDRESULTS SD_Write_Bytes(SD_DEV *dev, uint64_t addr, const void *dat, uint32_t len)
+{
+    SDRESULTS res;
+    SD_CLINE *line;
+    uint32_t sector;
+    uint16_t ofs, n;
+    const uint8_t *p = (const uint8_t *)dat;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if (!dev->lines) return(SD_REJECT);
+    if ((len == 0)||((addr + len - 1) / SD_BLK_SIZE > dev->last_sector)) return(SD_PARERR);
+    sector = (uint32_t)(addr / SD_BLK_SIZE);
+    ofs = (uint16_t)(addr % SD_BLK_SIZE);
+    do {
+        // Bytes changed in this sector
+        n = SD_BLK_SIZE - ofs;
+        if (n > len) n = len;
+        line = __SD_Cache_Find(dev, sector);
+        if (!line) {
+            res = __SD_Cache_Alloc(dev, sector, &line);
+            if (res != SD_OK) return(res);
+            // A whole sector is overwritten without reading it
+            if (n != SD_BLK_SIZE) {
+                res = SD_Read(dev, line->dat, sector, 0, SD_BLK_SIZE);
+                if (res != SD_OK) return(res);
+            }
+            line->valid = TRUE;
+        }
+        memcpy(line->dat + ofs, p, n);
+        if (!line->dirty) {
+            // The card content is going to change
+            line->dirty = TRUE;
+#if SD_IO_SKIP
+            __SD_Hash_Drop(dev, sector, 1);
+#endif
+#if SD_IO_ERASED
+            __SD_Erased_Drop(dev, sector, 1);
+#endif
+        }
+        p += n;
+        len -= n;
+        sector++;
+        ofs = 0;
+    } while (len);
+    return(SD_OK);
+}
+#endif
+
+SDRESULTS SD_Read_Blocks(SD_DEV *dev, void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint32_t done;
+    uint8_t trys;
+    uint8_t *p = (uint8_t *)dat;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if ((count == 0)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    // Sectors written with SD_Write_Bytes reach the card first
+    res = __SD_Cache_Flush(dev, sector, count);
+    if (res != SD_OK) return(res);
+#endif
+#if SD_IO_ERASED
+    if (__SD_Erased_Has(dev, sector, count)) {
+        memset(dat, dev->erase_val, count * SD_BLK_SIZE);
+        return(SD_OK);
+    }
+#endif
+    trys = 0;
+    do {
+        res = __SD_Read_Multi(dev, p, sector, count, &done, FALSE);
+        // Go on from the first block not received
+        p += done * SD_BLK_SIZE;
+        sector += done;
+        count -= done;
+        if(done) trys = 0;
+    } while(count && __SD_Retry(dev, res, trys++));
+    return(res);
+}
+
+#if SD_IO_ASYNC
+SDRESULTS SD_Read_Job(SD_DEV *dev, SD_RJOB *job)
+{
+    SDRESULTS res;
+    uint32_t done;
+    uint8_t trys;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if (job->count == 0) return(SD_OK);
+    if ((job->sector > dev->last_sector)||(job->count - 1 > dev->last_sector - job->sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    // Sectors written with SD_Write_Bytes reach the card first
+    res = __SD_Cache_Flush(dev, job->sector, job->count);
+    if (res != SD_OK) return(res);
+#endif
+    trys = 0;
+    do {
+        res = __SD_Read_Multi(dev, job->dat, job->sector, job->count, &done, TRUE);
+        job->dat += done * SD_BLK_SIZE;
+        job->sector += done;
+        job->count -= done;
+        if(done) trys = 0;
+        if((res == SD_OK) && job->count) {
+            // Stopped at a block boundary, the job is resumable
+            dev->preempt = FALSE;
+            return(SD_PREEMPTED);
+        }
+    } while(job->count && __SD_Retry(dev, res, trys++));
+    dev->preempt = FALSE;
+    return(res);
+}
+
+void SD_Preempt(SD_DEV *dev)
+{
+    dev->preempt = TRUE;
+}
+#endif
+
+SDRESULTS SD_Write_Blocks(SD_DEV *dev, const void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint32_t done;
+    uint8_t trys;
+    const uint8_t *p = (const uint8_t *)dat;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if ((count == 0)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    __SD_Cache_Drop(dev, sector, count);
+#endif
+#if SD_IO_SKIP
+    __SD_Hash_Drop(dev, sector, count);
+#endif
+#if SD_IO_ERASED
+    __SD_Erased_Drop(dev, sector, count);
+#endif
+    trys = 0;
+    do {
+        res = __SD_Write_Multi(dev, p, sector, count, &done);
+        // Go on from the first block not accepted
+        p += done * SD_BLK_SIZE;
+        sector += done;
+        count -= done;
+        if(done) trys = 0;
+    } while(count && __SD_Retry(dev, res, trys++));
+    return(res);
+}
+
+SDRESULTS SD_Readv(SD_DEV *dev, const SD_IOVEC *iov, uint8_t iovcnt, uint32_t sector)
+{
+    SDRESULTS res;
+    SD_IOCUR cur;
+    uint32_t count, base, done;
+    uint8_t trys;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    count = (__SD_Iov_Len(iov, iovcnt) + SD_BLK_SIZE - 1) / SD_BLK_SIZE;
+    if ((count == 0)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    // Sectors written with SD_Write_Bytes reach the card first
+    res = __SD_Cache_Flush(dev, sector, count);
+    if (res != SD_OK) return(res);
+#endif
+    trys = 0;
+    base = 0;
+    do {
+        // Go on from the first block not received
+        __SD_Iov_Seek(&cur, iov, iovcnt, base * SD_BLK_SIZE);
+        res = __SD_Readv_Multi(dev, &cur, sector + base, count - base, &done);
+        base += done;
+        if(done) trys = 0;
+    } while((base != count) && __SD_Retry(dev, res, trys++));
+    return(res);
+}
+
+SDRESULTS SD_Writev(SD_DEV *dev, const SD_IOVEC *iov, uint8_t iovcnt, uint32_t sector)
+{
+    SDRESULTS res;
+    SD_IOCUR cur;
+    uint32_t len, count, base, done;
+    uint8_t trys;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    len = __SD_Iov_Len(iov, iovcnt);
+    count = len / SD_BLK_SIZE;
+    if ((count == 0)||(len % SD_BLK_SIZE)||(sector > dev->last_sector)||(count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    __SD_Cache_Drop(dev, sector, count);
+#endif
+#if SD_IO_SKIP
+    __SD_Hash_Drop(dev, sector, count);
+#endif
+#if SD_IO_ERASED
+    __SD_Erased_Drop(dev, sector, count);
+#endif
+    trys = 0;
+    base = 0;
+    do {
+        // Go on from the first block not accepted
+        __SD_Iov_Seek(&cur, iov, iovcnt, base * SD_BLK_SIZE);
+        res = __SD_Writev_Multi(dev, &cur, sector + base, count - base, &done);
+        base += done;
+        if(done) trys = 0;
+    } while((base != count) && __SD_Retry(dev, res, trys++));
+    return(res);
+}
+
+SDRESULTS SD_Write_Open(SD_DEV *dev, uint32_t sector, uint32_t count)
+{
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if (sector > dev->last_sector) return(SD_PARERR);
+    if (count && (dev->cardtype & SDCT_SDC)) __SD_Send_Cmd(ACMD23, count);
+    if (__SD_Send_Cmd(CMD25, __SD_Addr(dev, sector)) != 0) {
+        __SD_Release();
+        return(SD_ERROR);
+    }
+    dev->xfer = TRUE;
+    dev->xfer_sector = sector;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Write_Next(SD_DEV *dev, const void *dat)
+{
+    SDRESULTS res;
+    __SD_Select(dev);
+    if ((!dev->xfer)||(dev->xfer_sector > dev->last_sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    __SD_Cache_Drop(dev, dev->xfer_sector, 1);
+#endif
+#if SD_IO_SKIP
+    __SD_Hash_Drop(dev, dev->xfer_sector, 1);
+#endif
+#if SD_IO_ERASED
+    __SD_Erased_Drop(dev, dev->xfer_sector, 1);
+#endif
+    // Multiple block write (token <- 0xFC)
+    res = __SD_Write_Block(dev, dat, 0xFC);
+    if (res == SD_OK) dev->xfer_sector++;
+    return(res);
+}
+
+SDRESULTS SD_Write_Close(SD_DEV *dev)
+{
+    SDRESULTS res;
+    __SD_Select(dev);
+    if (!dev->xfer) return(SD_OK);
+    dev->xfer = FALSE;
+    // Stop token, waits until the end of programming
+    res = __SD_Write_Block(dev, 0, 0xFD);
+    __SD_Release();
+    return(res);
+}
+
+SDRESULTS SD_Erase(SD_DEV *dev, uint32_t first, uint32_t last)
+{
+    SDRESULTS res;
+    uint8_t cmd;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if ((first > last)||(last > dev->last_sector)) return(SD_PARERR);
+#if SD_IO_CACHE
+    __SD_Cache_Drop(dev, first, last - first + 1);
+#endif
+#if SD_IO_SKIP
+    __SD_Hash_Drop(dev, first, last - first + 1);
+#endif
+#if SD_IO_ERASED
+    __SD_Erased_Drop(dev, first, last - first + 1);
+#endif
+    res = SD_ERROR;
+#if SD_IO_MMC
+    // MMC uses its own erase group commands
+    cmd = (dev->cardtype & SDCT_MMC) ? CMD35 : CMD32;
+#else
+    cmd = CMD32;
+#endif
+    if ((__SD_Send_Cmd(cmd, __SD_Addr(dev, first)) == 0) &&
+        (__SD_Send_Cmd(cmd + 1, __SD_Addr(dev, last)) == 0) &&
+        (__SD_Send_Cmd(CMD38, 0) == 0))
+        res = (__SD_Wait_Ready(SD_IO_ERASE_TIMEOUT_WAIT)==TRUE) ? SD_OK : SD_BUSY;
+    __SD_Release();
+#if SD_IO_ERASED
+    if ((res == SD_OK) && dev->nerased) __SD_Erased_Add(dev, first, last);
+#endif
+    return(res);
+}
+
+SDRESULTS SD_Sync(SD_DEV *dev)
+{
+    SDRESULTS res;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+#if SD_IO_CACHE
+    res = __SD_Cache_Flush(dev, 0, (uint32_t)-1);
+    if (res != SD_OK) return(res);
+#endif
+    __SD_Assert();
+    res = (__SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT)==TRUE) ? SD_OK : SD_BUSY;
+    __SD_Release();
+    return(res);
+}
+
+SDRESULTS SD_Erase_Size(SD_DEV *dev, uint32_t *sectors)
+{
+    SDRESULTS res;
+    // AU sizes of the SD status in 16 KiB units, SDXC adds 12, 24, 32 and 64 MB
+    static const uint16_t au[16] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 768, 1024, 1536, 2048, 4096};
+    uint8_t reg[64];
+    uint8_t n;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    if (dev->xfer) return(SD_BUSY);
+    if (dev->cardtype & SDCT_SD2) {
+        // AU_SIZE[431:428] of the SD status (ACMD13, R2 response)
+        res = SD_ERROR;
+        if (__SD_Send_Cmd(ACMD13, 0) == 0) {
+            SPI_RW(0xFF);
+            res = __SD_Rx_Data(reg, 64);
+        }
+        __SD_Release();
+        if (res == SD_OK) {
+            // 0 is "not defined": 1 tells the caller the size is unknown
+            n = reg[10] >> 4;
+            *sectors = n ? (uint32_t)au[n] * 32 : 1;
+        }
+    } else {
+        res = __SD_Read_Csd(reg);
+#if SD_IO_SD1
+        if ((res == SD_OK) && (dev->cardtype & SDCT_SD1)) {
+            // (SECTOR_SIZE[45:39] + 1) write blocks of 2^WRITE_BL_LEN[25:22]
+            n = ((reg[12] & 0x03) << 2) | (reg[13] >> 6);
+            *sectors = (((reg[10] & 0x3F) << 1) + (reg[11] >> 7) + 1);
+            *sectors <<= n;
+            *sectors /= SD_BLK_SIZE;
+        }
+#endif
+#if SD_IO_MMC
+        if ((res == SD_OK) && (dev->cardtype & SDCT_MMC)) {
+            // (ERASE_GRP_SIZE[46:42] + 1) * (ERASE_GRP_MULT[41:37] + 1)
+            *sectors = (((reg[10] & 0x7C) >> 2) + 1) * ((((reg[10] & 0x03) << 3) | (reg[11] >> 5)) + 1);
+        }
+#endif
+    }
+    return(res);
+}
+
+SDRESULTS SD_Status(SD_DEV *dev)
+{
+    uint8_t r1;
+    __SD_Select(dev);
+    if (!dev->mount) return(SD_NOINIT);
+    // SEND_STATUS answers with R2: R1 and a second status byte
+    r1 = __SD_Send_Cmd(CMD13, 0);
+    SPI_RW(0xFF);
+    __SD_Release();
+    if(r1 & 0x80) return(SD_NORESPONSE);
+    return(r1 ? SD_ERROR : SD_OK);
 }
\ No newline at end of file
@@ -8,36 +8,53 @@
 
 #include <stdint.h>
 
+#include "sd_config.h" /* Compile-time configuration */
 #include "spi_io.h" /* Provide the low-level functions */
 
-#define SD_IO_WRITE_TIMEOUT_WAIT 250
-
-
 /* Definitions of SD commands */
 #define CMD0    (0x40+0)        /* GO_IDLE_STATE            */
 #define CMD1    (0x40+1)        /* SEND_OP_COND (MMC)       */
 #define ACMD41  (0xC0+41)       /* SEND_OP_COND (SDC)       */
-#define CMD8    (0x40+8)        /* SEND_IF_COND             */
+#define CMD2    (0x40+2)        /* ALL_SEND_CID (SD bus)    */
+#define CMD3    (0x40+3)        /* SEND_RELATIVE_ADDR (bus) */
+#define ACMD6   (0xC0+6)        /* SET_BUS_WIDTH (SD bus)   */
+#define CMD6    (0x40+6)        /* SWITCH (MMC)             */
+#define CMD7    (0x40+7)        /* SELECT_CARD (SD bus)     */
+#define CMD8    (0x40+8)        /* SEND_IF_COND, EXT_CSD    */
 #define CMD9    (0x40+9)        /* SEND_CSD                 */
+#define CMD12   (0x40+12)       /* STOP_TRANSMISSION        */
+#define CMD13   (0x40+13)       /* SEND_STATUS              */
+#define ACMD13  (0xC0+13)       /* SD_STATUS (SDC)          */
 #define CMD16   (0x40+16)       /* SET_BLOCKLEN             */
 #define CMD17   (0x40+17)       /* READ_SINGLE_BLOCK        */
+#define CMD18   (0x40+18)       /* READ_MULTIPLE_BLOCK      */
+#define ACMD23  (0xC0+23)       /* SET_WR_BLK_ERASE_COUNT   */
 #define CMD24   (0x40+24)       /* WRITE_SINGLE_BLOCK       */
+#define CMD25   (0x40+25)       /* WRITE_MULTIPLE_BLOCK     */
+#define CMD32   (0x40+32)       /* ERASE_WR_BLK_START (SDC) */
+#define CMD33   (0x40+33)       /* ERASE_WR_BLK_END (SDC)   */
+#define CMD35   (0x40+35)       /* ERASE_GROUP_START (MMC)  */
+#define CMD36   (0x40+36)       /* ERASE_GROUP_END (MMC)    */
+#define CMD38   (0x40+38)       /* ERASE                    */
 #define CMD42   (0x40+42)       /* LOCK_UNLOCK              */
+#define ACMD51  (0xC0+51)       /* SEND_SCR (SDC)           */
 #define CMD55   (0x40+55)       /* APP_CMD                  */
 #define CMD58   (0x40+58)       /* READ_OCR                 */
 #define CMD59   (0x40+59)       /* CRC_ON_OFF               */
 
-#define SD_INIT_TRYS    0x03
-
 /* CardType) */
-#define SDCT_MMC        0x01                    /* MMC version 3    */
+#define SDCT_MMC        0x01                    /* MMC              */
 #define SDCT_SD1        0x02                    /* SD version 1     */
 #define SDCT_SD2        0x04                    /* SD version 2     */
 #define SDCT_SDC        (SDCT_SD1|SDCT_SD2)     /* SD               */
 #define SDCT_BLOCK      0x08                    /* Block addressing */
+#define SDCT_RDPART     0x10                    /* Partial reads    */
 
 #define SD_BLK_SIZE     512
 
+/* CMD1 argument: sector mode offered, 2.7-3.6V */
+#define SD_MMC_OCR      0x40FF8000UL
+
 /* Results of SD functions */
 typedef enum {
     SD_OK = 0,      /* 0: Function succeeded    */
@@ -46,14 +63,97 @@ typedef enum {
     SD_PARERR,      /* 3: Invalid parameter     */
     SD_BUSY,        /* 4: Programming busy      */
     SD_REJECT,      /* 5: Reject data           */
-    SD_NORESPONSE   /* 6: No response           */
+    SD_NORESPONSE,  /* 6: No response           */
+    SD_PREEMPTED    /* 7: Stopped by SD_Preempt */
 } SDRESULTS;
 
+#if SD_IO_STATS
+/* Recovery counters */
+typedef struct _SD_STATS {
+    uint16_t retries;   /* Operations retried after a failure       */
+    uint16_t stops;     /* CMD12 (stop transmission) recoveries     */
+    uint16_t status;    /* CMD13 (send status) recoveries           */
+    uint16_t reinits;   /* Escalations to full re-init (CMD0)       */
+    uint16_t failures;  /* Operations failed after all the retries  */
+#if SD_IO_SKIP
+    uint16_t skips;     /* SD_Write skipped, content unchanged      */
+#endif
+} SD_STATS;
+#endif
+
+/* Segment of a vectored transfer */
+typedef struct _SD_IOVEC {
+    void *buf;          /* Data of the segment, NULL skips/pads */
+    uint16_t len;       /* Bytes of the segment                 */
+} SD_IOVEC;
+
+#if SD_IO_CACHE
+/* Line of the sector cache */
+typedef struct _SD_CLINE {
+    uint32_t sector;
+    uint8_t valid;
+    uint8_t dirty;      /* Changed by SD_Write_Bytes, not written yet */
+    uint8_t dat[SD_BLK_SIZE];
+} SD_CLINE;
+#endif
+
+#if SD_IO_SKIP
+/* Hash of the last content written to a sector */
+typedef struct _SD_SHASH {
+    uint32_t sector;
+    uint32_t hash;      /* FNV-1a, 0 marks a free entry */
+} SD_SHASH;
+#endif
+
+#if SD_IO_ERASED
+/* Run of erased sectors */
+typedef struct _SD_ERANGE {
+    uint32_t first;
+    uint32_t count;
+} SD_ERANGE;
+#endif
+
+#if SD_IO_ASYNC
+/* Resumable multiple block read */
+typedef struct _SD_RJOB {
+    uint8_t *dat;       /* Destination of the next sector   */
+    uint32_t sector;    /* Next sector                      */
+    uint32_t count;     /* Sectors left                     */
+} SD_RJOB;
+#endif
+
 /* SD device object */
 typedef struct _SD_DEV {
+#if SD_IO_CARDS > 1
+    uint8_t cs;             /* Chip select of the card (SPI_CS_Sel) */
+#endif
     uint8_t mount;
     uint8_t cardtype;
-    uint16_t last_sector;
+    uint32_t last_sector;
+    uint32_t xfer_sector;   /* Next sector of an open write session */
+    uint8_t xfer;           /* Write session open                   */
+#if SD_IO_CACHE
+    SD_CLINE *cache;        /* Sector cache lines (SD_Cache)        */
+    uint8_t lines;          /* Number of cache lines                */
+    uint8_t victim;         /* Next line to replace                 */
+#endif
+#if SD_IO_SKIP
+    SD_SHASH *hashes;       /* Hashes of written sectors (SD_Skip)  */
+    uint8_t nhash;          /* Number of hash entries               */
+    uint8_t hvictim;        /* Next entry to replace                */
+#endif
+#if SD_IO_ERASED
+    SD_ERANGE *erased;      /* Erased ranges (SD_Erased), unsorted  */
+    uint8_t nerased;        /* Number of range entries              */
+    uint8_t eused;          /* Entries in use                       */
+    uint8_t erase_val;      /* Content of erased sectors            */
+#endif
+#if SD_IO_ASYNC
+    volatile uint8_t preempt;   /* Stop of SD_Read_Job requested    */
+#endif
+#if SD_IO_STATS
+    SD_STATS stats;
+#endif
 } SD_DEV;
 
 /*******************************************************************************
@@ -62,22 +162,134 @@ typedef struct _SD_DEV {
 
 /**
     \brief Initialization the SD card.
+    \details Detaches the sector cache, if any.
     \return If all goes well returns SD_OK.
  */
 SDRESULTS SD_Init (SD_DEV *dev);
 
+/**
+    \brief Initialize again a card that was already identified by SD_Init.
+    \details Meant for power cycled cards: the power up wait is only
+    SD_IO_REMOUNT_WAIT and the card type, capacity and sector cache are kept,
+    so the CSD and the OCR aren't read again. Falls back on a full
+    initialization if the card doesn't answer as the same type.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Remount(SD_DEV *dev);
+
+#if SD_IO_CARDS > 1
+/**
+    \brief Initialization of several cards at once.
+    \details The cards share one power up wait, and CMD0 and the operating
+    condition polling go round robin over them, so the boot time doesn't
+    grow with the number of cards. The cs of each device must be set. A card
+    that doesn't come up this way gets a full SD_Init of its own.
+    \param dev Table of devices.
+    \param n Number of devices (1..SD_IO_CARDS).
+    \return SD_OK if every card is initialized.
+ */
+SDRESULTS SD_Init_All(SD_DEV *dev, uint8_t n);
+#endif
+
+#if SD_IO_CACHE
+/**
+    \brief Attach a sector cache to an initialized device.
+    \details SD_Read is served from cached sectors, SD_Write keeps them up to
+    date (write-through) and the other writes drop them. SD_Read_Bytes also
+    loads into the cache the last sector that it only reads in part. The
+    dirty lines of SD_Write_Bytes are written back before a new cache
+    replaces the old one.
+    \param lines Cache lines, NULL to detach the cache.
+    \param n Number of lines.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Cache(SD_DEV *dev, SD_CLINE *lines, uint8_t n);
+#endif
+
+#if SD_IO_SKIP
+/**
+    \brief Attach a table of sector hashes to an initialized device.
+    \details SD_Write keeps there the FNV-1a hash of what it writes and skips
+    the CMD24 when the new data hashes the same (a different content with the
+    same hash, a 1 in 2^32 chance, would be lost). A sector in the cache is
+    compared byte by byte instead, without a table.
+    \param tab Hash entries, NULL to detach the table.
+    \param n Number of entries.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Skip(SD_DEV *dev, SD_SHASH *tab, uint8_t n);
+#endif
+
+#if SD_IO_ERASED
+/**
+    \brief Attach a map of erased ranges to an initialized SD card.
+    \details The value of erased data is taken from DATA_STAT_AFTER_ERASE of
+    the SCR (ACMD51). SD_Erase adds its range to the map and every write
+    takes its sectors out. SD_Read and SD_Read_Blocks of sectors inside an
+    erased range fill the buffer without any command. When the map is full
+    the shortest ranges are forgotten. Not available on MMC.
+    \param map Range entries, NULL to detach the map.
+    \param n Number of entries.
+    \return If all goes well returns SD_OK, SD_REJECT on MMC.
+ */
+SDRESULTS SD_Erased(SD_DEV *dev, SD_ERANGE *map, uint8_t n);
+
+/**
+    \brief Declare sectors as erased, e.g. a range erased before a reboot.
+    \param first First sector.
+    \param count Number of sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Erased_Mark(SD_DEV *dev, uint32_t first, uint32_t count);
+#endif
+
 /**
     \brief Read a single block.
+    \details A failed read is retried up to SD_IO_RETRYS times, after a
+    CMD12/CMD13 recovery or a re-init of the card (see SD_STATS). On byte
+    addressed cards that allow partial blocks, reads up to SD_IO_PARTIAL_MAX
+    bytes only transfer the requested bytes.
     \param dest Pointer to the destination object to put data
     \param sector Start sector number (internally is converted to byte address).
     \param ofs Byte offset in the sector (0..511).
-    \param cnt Byte count (1..512).
+    \param cnt Byte count (1..512), ofs + cnt can't exceed 512.
     \return If all goes well returns SD_OK.
  */
 SDRESULTS SD_Read(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt);
 
+/**
+    \brief Read bytes from any byte address, across sector boundaries.
+    \details A range inside a sector is read like SD_Read; longer ranges
+    use vectored multiple block reads that only skip the bytes before the
+    address and after the range. Sectors in the cache aren't read again.
+    \param addr Byte address.
+    \param dat Pointer to the destination object to put data.
+    \param len Byte count (1..).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Read_Bytes(SD_DEV *dev, uint64_t addr, void *dat, uint32_t len);
+
+#if SD_IO_CACHE
+/**
+    \brief Write bytes at any byte address, across sector boundaries.
+    \details The sectors are changed in the cache (read first unless the
+    whole sector is written) and left dirty, so small updates of a sector
+    are merged into a single write. Dirty lines go to the card, runs of
+    consecutive sectors with one multiple block write, when their line is
+    replaced, before a multiple block read of them, and on SD_Sync or
+    SD_Cache. Reads see the new data at once. Needs a cache (SD_Cache).
+    \param addr Byte address.
+    \param dat Data to write.
+    \param len Byte count (1..).
+    \return If all goes well returns SD_OK, SD_REJECT without a cache.
+ */
+SDRESULTS SD_Write_Bytes(SD_DEV *dev, uint64_t addr, const void *dat, uint32_t len);
+#endif
+
 /**
     \brief Write a single block.
+    \details A failed write is retried like in SD_Read. With SD_IO_SKIP
+    nothing is sent if the sector already holds the same data.
     \param dat Data to write.
     \param sector Sector number to write (internally is converted to byte address).
     \return If all goes well returns SD_OK.
@@ -85,7 +297,119 @@ SDRESULTS SD_Read(SD_DEV *dev, void *dat, uint32_t sector, uint16_t ofs, uint16_
 SDRESULTS SD_Write(SD_DEV *dev, void *dat, uint32_t sector);
 
 /**
-    \brief Allows know status of SD card.
+    \brief Read consecutive blocks with a single multiple block command.
+    \details A failed transfer is retried from the first block not received.
+    \param dat Pointer to the destination object (count * 512 bytes).
+    \param sector Start sector number.
+    \param count Number of sectors to read.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Read_Blocks(SD_DEV *dev, void *dat, uint32_t sector, uint32_t count);
+
+/**
+    \brief Write consecutive blocks with a single multiple block command.
+    \details A failed transfer is retried from the first block not accepted.
+    \param dat Data to write (count * 512 bytes).
+    \param sector Start sector number.
+    \param count Number of sectors to write.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write_Blocks(SD_DEV *dev, const void *dat, uint32_t sector, uint32_t count);
+
+/**
+    \brief Read consecutive blocks into a list of buffers (scatter).
+    \details The segments are filled in order from the first byte of the
+    sector; bytes of the last sector beyond the segments and bytes of NULL
+    segments are skipped. One sector uses CMD17, more use CMD18. Retried
+    like SD_Read_Blocks.
+    \param iov Segments.
+    \param iovcnt Number of segments.
+    \param sector Start sector number.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Readv(SD_DEV *dev, const SD_IOVEC *iov, uint8_t iovcnt, uint32_t sector);
+
+/**
+    \brief Write consecutive blocks from a list of buffers (gather).
+    \details The segments are sent in order without a staging copy; their
+    total length must be a multiple of 512. NULL segments send 0xFF.
+    Retried like SD_Write_Blocks.
+    \param iov Segments.
+    \param iovcnt Number of segments.
+    \param sector Start sector number.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Writev(SD_DEV *dev, const SD_IOVEC *iov, uint8_t iovcnt, uint32_t sector);
+
+#if SD_IO_ASYNC
+/**
+    \brief Run a multiple block read that can be preempted.
+    \details Like SD_Read_Blocks, but after each block the preempt flag of
+    the device is checked. If SD_Preempt was called the transfer is stopped
+    there with CMD12 and the job keeps the position; calling SD_Read_Job
+    again resumes it. At least one block is read on each call.
+    \param job Destination, start sector and count; updated as it goes.
+    \return SD_OK when the job is complete, SD_PREEMPTED if stopped.
+ */
+SDRESULTS SD_Read_Job(SD_DEV *dev, SD_RJOB *job);
+
+/**
+    \brief Ask the running SD_Read_Job to stop at the next block boundary.
+    \details Can be called from an interrupt or another task; the caller
+    must then wait until SD_Read_Job returns to use the card.
+ */
+void SD_Preempt(SD_DEV *dev);
+#endif
+
+/**
+    \brief Open a multiple block write session (CMD25).
+    \details Blocks are then sent one by one with SD_Write_Next, so a long
+    stream of sectors doesn't need to be in RAM at once. Until the session
+    is closed the card stays selected and no other method can be used on
+    it. There aren't retries inside a session.
+    \param sector Start sector number.
+    \param count Sectors that will be written (pre-erase hint), 0 if unknown.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write_Open(SD_DEV *dev, uint32_t sector, uint32_t count);
+
+/**
+    \brief Write the next block of an open write session.
+    \param dat Data to write (512 bytes).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write_Next(SD_DEV *dev, const void *dat);
+
+/**
+    \brief Close a write session, waits until the end of programming.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write_Close(SD_DEV *dev);
+
+/**
+    \brief Erase a range of sectors.
+    \param first First sector of the range.
+    \param last Last sector of the range (included).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Erase(SD_DEV *dev, uint32_t first, uint32_t last);
+
+/**
+    \brief Wait until the card finishes any internal programming.
+    \details The dirty cache lines of SD_Write_Bytes are written first.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Sync(SD_DEV *dev);
+
+/**
+    \brief Get the erase block size (AU size on SDv2 cards).
+    \param sectors Returns the size in sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Erase_Size(SD_DEV *dev, uint32_t *sectors);
+
+/**
+    \brief Allows know status of SD card (CMD13).
     \return If all goes well returns SD_OK.
 */
 SDRESULTS SD_Status (SD_DEV *dev);
@@ -0,0 +1,839 @@
+/*
+ * sd_io.hpp: Header-only C++17 SD driver with the SPI port as a policy.
+ * See LICENSE.
+ *
+ * SdCard<SpiPolicy, Config> speaks the same SPI mode protocol as sd_io.c,
+ * but the port is a class of static methods instead of the extern "C"
+ * functions of spi_io.h: byte transfers, CS and timers inline into the
+ * protocol code. The settings are constexpr members of Config, so the
+ * paths of card types switched off and the CRC code are discarded at
+ * compile time. A policy has the methods of spi_io.h without the prefix:
+ *
+ *     struct MySpi {
+ *         static void Init();
+ *         static uint8_t RW(uint8_t d);
+ *         static void Release();
+ *         static void CS_Low();
+ *         static void CS_High();
+ *         static void Freq_High();
+ *         static void Freq_Low();
+ *         static void Timer_On(uint16_t ms);
+ *         static bool Timer_Status();
+ *         static void Timer_Off();
+ *     };
+ *
+ * SpiC forwards to an existing C port. Results, commands and card types
+ * are the ones of sd_io.h.
+ *
+ * Every command goes out under a Transaction, a guard that selects the card
+ * when it is built and releases the bus when it goes out of scope: no
+ * command is sent unselected and no CS is left asserted on a return path.
+ * Multiple block write sessions are Write_Session objects that can be moved
+ * but not copied. With C++20 the transfers also take std::span<std::byte>.
+ */
+
+#ifndef _SD_IO_HPP_
+#define _SD_IO_HPP_
+
+#include <stdint.h>
+#include <string.h>
+
+#if (__cplusplus >= 202002L) && defined(__has_include)
+#if __has_include(<span>)
+#include <cstddef>
+#include <span>
+#define SD_IO_HPP_SPAN      1
+#endif
+#endif
+
+extern "C" {
+#include "sd_io.h"
+}
+
+/* Defaults: the values of sd_config.h. Derive and hide members to change. */
+struct SdConfig {
+    static constexpr bool mmc = SD_IO_MMC;              /* MMC, MMCv4/eMMC      */
+    static constexpr bool sd1 = SD_IO_SD1;              /* SD version 1         */
+    static constexpr bool sdsc = SD_IO_SDSC;            /* Byte addressed cards */
+    static constexpr bool crc = SD_IO_CRC;              /* CRC7/CRC16 (CMD59)   */
+    static constexpr uint16_t block_size = SD_BLK_SIZE;
+    static constexpr uint8_t retrys = SD_IO_RETRYS;
+    static constexpr bool retry_reinit = SD_IO_RETRY_REINIT; /* Re-init a lost card */
+    static constexpr uint8_t init_trys = SD_INIT_TRYS;
+    static constexpr uint16_t write_timeout = SD_IO_WRITE_TIMEOUT_WAIT;
+    static constexpr uint16_t read_timeout = SD_IO_READ_TIMEOUT_WAIT;
+    static constexpr uint16_t erase_timeout = SD_IO_ERASE_TIMEOUT_WAIT;
+    static constexpr uint16_t cmd_timeout = SD_IO_CMD_TIMEOUT_WAIT;
+    static constexpr uint16_t powerup_wait = SD_IO_POWERUP_WAIT;
+    static constexpr uint16_t idle_timeout = SD_IO_IDLE_TIMEOUT_WAIT;
+    static constexpr uint16_t init_timeout = SD_IO_INIT_TIMEOUT_WAIT;
+    static constexpr uint16_t init_v1_timeout = SD_IO_INIT_V1_TIMEOUT_WAIT;
+};
+
+/* Policy over the C port of spi_io.h */
+struct SpiC {
+    static void Init() { SPI_Init(); }
+    static uint8_t RW(uint8_t d) { return SPI_RW(d); }
+    static void Release() { SPI_Release(); }
+    static void CS_Low() { SPI_CS_Low(); }
+    static void CS_High() { SPI_CS_High(); }
+    static void Freq_High() { SPI_Freq_High(); }
+    static void Freq_Low() { SPI_Freq_Low(); }
+    static void Timer_On(uint16_t ms) { SPI_Timer_On(ms); }
+    static bool Timer_Status() { return SPI_Timer_Status(); }
+    static void Timer_Off() { SPI_Timer_Off(); }
+};
+
+template <class Spi, class Config = SdConfig>
+class SdCard {
+    static_assert(Config::block_size == 512, "SD cards transfer 512 byte blocks");
+    static_assert(Config::sdsc || !Config::sd1, "SDv1 cards are byte addressed, they need sdsc");
+
+public:
+    /**
+        \brief Chip select held for the lifetime of the object.
+        \details The card is selected (CS high, a byte, CS low, a byte) on
+        construction. On destruction, or End, the bus is released: the
+        policy Release, CS high and 8 trailing clocks so the card lets go of
+        DO. Movable, the moved-from guard releases nothing.
+     */
+    class Transaction {
+    public:
+        Transaction() : Transaction(true) {}
+        explicit Transaction(bool select) : live_(select)
+        {
+            if (!select) return;
+            Spi::CS_High();
+            Spi::RW(0xFF);
+            Spi::CS_Low();
+            Spi::RW(0xFF);
+        }
+        Transaction(Transaction &&o) noexcept : live_(o.live_) { o.live_ = false; }
+        Transaction &operator=(Transaction &&o) noexcept
+        {
+            if (this != &o) {
+                End();
+                live_ = o.live_;
+                o.live_ = false;
+            }
+            return *this;
+        }
+        Transaction(const Transaction &) = delete;
+        Transaction &operator=(const Transaction &) = delete;
+        ~Transaction() { End(); }
+
+        void End()
+        {
+            if (!live_) return;
+            live_ = false;
+            Spi::Release();
+            Spi::CS_High();
+            Spi::RW(0xFF);
+        }
+
+    private:
+        bool live_;
+    };
+
+    /**
+        \brief Multiple block write session (CMD25), see Write_Open.
+        \details The card stays selected while the session is open and the
+        other methods return SD_BUSY. Closed by Close or by the destructor;
+        a move hands the open session over. The card object must outlive it
+        (SdCard can't be copied or moved).
+     */
+    class Write_Session {
+    public:
+        Write_Session() = default;
+        Write_Session(Write_Session &&o) noexcept
+            : card_(o.card_), t_(static_cast<Transaction &&>(o.t_)), sector_(o.sector_)
+        {
+            o.card_ = nullptr;
+        }
+        Write_Session &operator=(Write_Session &&o) noexcept
+        {
+            if (this != &o) {
+                Close();
+                card_ = o.card_;
+                t_ = static_cast<Transaction &&>(o.t_);
+                sector_ = o.sector_;
+                o.card_ = nullptr;
+            }
+            return *this;
+        }
+        Write_Session(const Write_Session &) = delete;
+        Write_Session &operator=(const Write_Session &) = delete;
+        ~Write_Session() { Close(); }
+
+        bool Is_Open() const { return card_ != nullptr; }
+
+        /**
+            \brief Write the next block (512 bytes).
+            \return If all goes well returns SD_OK.
+         */
+        SDRESULTS Next(const void *dat)
+        {
+            SDRESULTS res;
+            if (!card_ || (sector_ > card_->last_sector_)) return SD_PARERR;
+            res = card_->Write_Block(dat, 0xFC);
+            if (res == SD_OK) sector_++;
+            return res;
+        }
+
+#ifdef SD_IO_HPP_SPAN
+        SDRESULTS Next(std::span<const std::byte> dat)
+        {
+            if (dat.size() != SD_BLK_SIZE) return SD_PARERR;
+            return Next(static_cast<const void *>(dat.data()));
+        }
+#endif
+
+        /**
+            \brief Stop token, waits until the end of programming.
+            \return If all goes well returns SD_OK.
+         */
+        SDRESULTS Close()
+        {
+            SDRESULTS res;
+            if (!card_) return SD_OK;
+            res = card_->Write_Block(0, 0xFD);
+            card_->xfer_ = false;
+            card_ = nullptr;
+            t_.End();
+            return res;
+        }
+
+    private:
+        friend class SdCard;
+        SdCard *card_ = nullptr;
+        Transaction t_{false};
+        uint32_t sector_ = 0;
+    };
+
+    /* The card owns the chip select state, open sessions point to it */
+    SdCard() = default;
+    SdCard(const SdCard &) = delete;
+    SdCard &operator=(const SdCard &) = delete;
+
+    /**
+        \brief Initialization the SD card.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Init();
+
+    /**
+        \brief Read a part of a block.
+        \param dat Pointer to the destination object to put data.
+        \param sector Sector number.
+        \param ofs Byte offset in the sector (0..511).
+        \param cnt Byte count (1..512), ofs + cnt can't exceed 512.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Read(void *dat, uint32_t sector, uint16_t ofs = 0, uint16_t cnt = SD_BLK_SIZE);
+
+    /**
+        \brief Write a single block.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Write(const void *dat, uint32_t sector);
+
+    /**
+        \brief Read consecutive blocks with a single CMD18.
+        \details A failed transfer is retried from the first block not received.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Read_Blocks(void *dat, uint32_t sector, uint32_t count);
+
+    /**
+        \brief Write consecutive blocks with a single CMD25.
+        \details A failed transfer is retried from the first block not accepted.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Write_Blocks(const void *dat, uint32_t sector, uint32_t count);
+
+    /**
+        \brief Erase a range of sectors.
+        \param first First sector of the range.
+        \param last Last sector of the range (included).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Erase(uint32_t first, uint32_t last);
+
+    /**
+        \brief Wait until the card finishes any internal programming.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Sync();
+
+    /**
+        \brief Status of the card (CMD13).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Status();
+
+    /**
+        \brief Open a multiple block write session.
+        \param s Session, open afterwards if all goes well.
+        \param sector Start sector number.
+        \param count Sectors that will be written (pre-erase hint), 0 if unknown.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS Write_Open(Write_Session &s, uint32_t sector, uint32_t count);
+
+#ifdef SD_IO_HPP_SPAN
+    /* Sizes come from the spans: 1..512 - ofs bytes for Read, 512 for
+       Write, a multiple of 512 for the block transfers. */
+    SDRESULTS Read(std::span<std::byte> dat, uint32_t sector, uint16_t ofs = 0)
+    {
+        if (dat.empty() || (ofs >= SD_BLK_SIZE) || (dat.size() > (size_t)(SD_BLK_SIZE - ofs))) return SD_PARERR;
+        return Read(static_cast<void *>(dat.data()), sector, ofs, (uint16_t)dat.size());
+    }
+    SDRESULTS Write(std::span<const std::byte> dat, uint32_t sector)
+    {
+        if (dat.size() != SD_BLK_SIZE) return SD_PARERR;
+        return Write(static_cast<const void *>(dat.data()), sector);
+    }
+    SDRESULTS Read_Blocks(std::span<std::byte> dat, uint32_t sector)
+    {
+        if (dat.empty() || (dat.size() % SD_BLK_SIZE)) return SD_PARERR;
+        return Read_Blocks(static_cast<void *>(dat.data()), sector, (uint32_t)(dat.size() / SD_BLK_SIZE));
+    }
+    SDRESULTS Write_Blocks(std::span<const std::byte> dat, uint32_t sector)
+    {
+        if (dat.empty() || (dat.size() % SD_BLK_SIZE)) return SD_PARERR;
+        return Write_Blocks(static_cast<const void *>(dat.data()), sector, (uint32_t)(dat.size() / SD_BLK_SIZE));
+    }
+#endif
+
+    uint8_t Card_Type() const { return cardtype_; }
+    uint32_t Last_Sector() const { return last_sector_; }
+    bool Mounted() const { return mount_; }
+
+private:
+    uint8_t cardtype_ = 0;
+    uint32_t last_sector_ = 0;
+    bool mount_ = false;
+    bool xfer_ = false;
+    uint16_t crc16_ = 0;
+
+    static constexpr bool byte_addr_ = Config::sdsc;
+
+    uint32_t Addr(uint32_t sector) const
+    {
+        if constexpr (byte_addr_) return (cardtype_ & SDCT_BLOCK) ? sector : sector * SD_BLK_SIZE;
+        else return sector;
+    }
+
+    static uint8_t Crc7(uint8_t crc, uint8_t d)
+    {
+        for (uint8_t bit = 0; bit != 8; bit++) {
+            crc <<= 1;
+            if ((d ^ crc) & 0x80) crc ^= 0x09;
+            d <<= 1;
+        }
+        return crc & 0x7F;
+    }
+
+    static uint16_t Crc16_Byte(uint16_t crc, uint8_t d)
+    {
+        crc = (crc >> 8) | (crc << 8);
+        crc ^= d;
+        crc ^= (crc & 0xFF) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xFF) << 5;
+        return crc;
+    }
+
+    uint8_t Send_Cmd(Transaction &t, uint8_t cmd, uint32_t arg);
+    bool Wait_Ready(uint16_t ms);
+    uint8_t Wait_Token();
+    void Rx_Bytes(uint8_t *dat, uint16_t cnt);
+    void Tx_Bytes(const uint8_t *dat, uint16_t cnt);
+    SDRESULTS Rx_End();
+    SDRESULTS Tx_End();
+    SDRESULTS Rx_Data(void *dat, uint16_t cnt);
+    SDRESULTS Write_Block(const void *dat, uint8_t token);
+    uint8_t Ocr(Transaction &t, uint8_t ct);
+    uint32_t Sectors();
+    SDRESULTS Read_Block(void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt);
+    SDRESULTS Read_Multi(uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done);
+    SDRESULTS Write_Multi(const uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done);
+    bool Retry(SDRESULTS res, uint8_t trys);
+};
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+template <class Spi, class Config>
+uint8_t SdCard<Spi, Config>::Send_Cmd(Transaction &t, uint8_t cmd, uint32_t arg)
+{
+    uint8_t crc, res;
+    // ACMD«n» is the command sequence of CMD55-CMD«n»
+    if (cmd & 0x80) {
+        cmd &= 0x7F;
+        res = Send_Cmd(t, CMD55, 0);
+        if (res > 1) return res;
+    }
+    // The transaction selected the card; a byte of gap between commands,
+    // but not in the middle of a multiple block read
+    if (cmd != CMD12) Spi::RW(0xFF);
+    Spi::RW(cmd);
+    Spi::RW((uint8_t)(arg >> 24));
+    Spi::RW((uint8_t)(arg >> 16));
+    Spi::RW((uint8_t)(arg >> 8));
+    Spi::RW((uint8_t)arg);
+    if constexpr (Config::crc) {
+        crc = Crc7(0, cmd);
+        for (uint8_t idx = 4; idx; idx--) crc = Crc7(crc, (uint8_t)(arg >> (8 * (idx - 1))));
+        crc = (crc << 1) | 0x01;
+    } else {
+        crc = 0x01;                         // Dummy CRC and stop
+        if (cmd == CMD0) crc = 0x95;        // Valid CRC for CMD0(0)
+        if (cmd == CMD8) crc = 0x87;        // Valid CRC for CMD8(0x1AA)
+    }
+    Spi::RW(crc);
+    // Skip the stuff byte that follows a stop transmission
+    if (cmd == CMD12) Spi::RW(0xFF);
+    Spi::Timer_On(Config::cmd_timeout);
+    do {
+        res = Spi::RW(0xFF);
+    } while ((res & 0x80) && Spi::Timer_Status());
+    Spi::Timer_Off();
+    return res;
+}
+
+template <class Spi, class Config>
+bool SdCard<Spi, Config>::Wait_Ready(uint16_t ms)
+{
+    uint8_t line;
+    Spi::Timer_On(ms);
+    do {
+        line = Spi::RW(0xFF);
+    } while ((line != 0xFF) && Spi::Timer_Status());
+    Spi::Timer_Off();
+    return line == 0xFF;
+}
+
+template <class Spi, class Config>
+uint8_t SdCard<Spi, Config>::Wait_Token()
+{
+    uint8_t tkn;
+    Spi::Timer_On(Config::read_timeout);
+    do {
+        tkn = Spi::RW(0xFF);
+    } while ((tkn == 0xFF) && Spi::Timer_Status());
+    Spi::Timer_Off();
+    return tkn;
+}
+
+template <class Spi, class Config>
+void SdCard<Spi, Config>::Rx_Bytes(uint8_t *dat, uint16_t cnt)
+{
+    while (cnt--) {
+        uint8_t d = Spi::RW(0xFF);
+        if constexpr (Config::crc) crc16_ = Crc16_Byte(crc16_, d);
+        if (dat) *dat++ = d;
+    }
+}
+
+template <class Spi, class Config>
+void SdCard<Spi, Config>::Tx_Bytes(const uint8_t *dat, uint16_t cnt)
+{
+    while (cnt--) {
+        uint8_t d = *dat++;
+        if constexpr (Config::crc) crc16_ = Crc16_Byte(crc16_, d);
+        Spi::RW(d);
+    }
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Rx_End()
+{
+    uint16_t crc = (uint16_t)Spi::RW(0xFF) << 8;
+    crc |= Spi::RW(0xFF);
+    if constexpr (Config::crc) return (crc == crc16_) ? SD_OK : SD_ERROR;
+    else return SD_OK;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Tx_End()
+{
+    if constexpr (Config::crc) {
+        Spi::RW((uint8_t)(crc16_ >> 8));
+        Spi::RW((uint8_t)crc16_);
+    } else {
+        Spi::RW(0xFF);
+        Spi::RW(0xFF);
+    }
+    if ((Spi::RW(0xFF) & 0x1F) != 0x05) return SD_REJECT;
+    return Wait_Ready(Config::write_timeout) ? SD_OK : SD_BUSY;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Rx_Data(void *dat, uint16_t cnt)
+{
+    uint8_t tkn = Wait_Token();
+    if (tkn == 0xFF) return SD_NORESPONSE;
+    if (tkn != 0xFE) return SD_ERROR;
+    crc16_ = 0;
+    Rx_Bytes((uint8_t *)dat, cnt);
+    return Rx_End();
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Write_Block(const void *dat, uint8_t token)
+{
+    Spi::RW(token);
+    // Stop token of a multiple block write? Busy starts a byte later
+    if (token == 0xFD) {
+        Spi::RW(0xFF);
+        return Wait_Ready(Config::write_timeout) ? SD_OK : SD_BUSY;
+    }
+    crc16_ = 0;
+    Tx_Bytes((const uint8_t *)dat, SD_BLK_SIZE);
+    return Tx_End();
+}
+
+template <class Spi, class Config>
+uint8_t SdCard<Spi, Config>::Ocr(Transaction &t, uint8_t ct)
+{
+    uint8_t ocr[4];
+    if (!ct || Send_Cmd(t, CMD58, 0)) return 0;
+    for (uint8_t n = 0; n < 4; n++) ocr[n] = Spi::RW(0xFF);
+    if (ocr[0] & 0x40) return ct | SDCT_BLOCK;
+    // Byte addressed cards need sdsc
+    return Config::sdsc ? ct : 0;
+}
+
+template <class Spi, class Config>
+uint32_t SdCard<Spi, Config>::Sectors()
+{
+    uint8_t csd[16];
+    SDRESULTS res = SD_ERROR;
+    {
+        Transaction t;
+        if (Send_Cmd(t, CMD9, 0) == 0) res = Rx_Data(csd, 16);
+    }
+    if (res != SD_OK) return 0;
+    bool mmc = false;
+    if constexpr (Config::mmc) mmc = (cardtype_ & SDCT_MMC) != 0;
+    if (mmc && (cardtype_ & SDCT_BLOCK)) {
+        // Sector mode MMC: SEC_COUNT [215:212] of the EXT_CSD (CMD8)
+        uint8_t b[4];
+        if (((csd[0] >> 2) & 0x0F) < 4) return 0;
+        res = SD_ERROR;
+        {
+            Transaction t;
+            if ((Send_Cmd(t, CMD8, 0) == 0) && (Wait_Token() == 0xFE)) {
+                crc16_ = 0;
+                Rx_Bytes(0, 212);
+                Rx_Bytes(b, 4);
+                Rx_Bytes(0, SD_BLK_SIZE - 216);
+                res = Rx_End();
+            }
+        }
+        if (res != SD_OK) return 0;
+        return ((uint32_t)b[3] << 24) | ((uint32_t)b[2] << 16) | ((uint32_t)b[1] << 8) | b[0];
+    }
+    // CSD_STRUCTURE[127:126]: version 2.0 (SDHC/SDXC)? MMC uses 1 for v1.1
+    if (!mmc && ((csd[0] >> 6) == 1)) {
+        uint32_t c_size = ((uint32_t)(csd[7] & 0x3F) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+        return (c_size + 1) << 10;
+    }
+    if constexpr (Config::sdsc) {
+        // Version 1.0: C_SIZE [73:62], C_SIZE_MULT [49:47], READ_BL_LEN[83:80]
+        uint32_t c_size = ((uint32_t)(csd[6] & 0x03) << 10) | ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+        uint8_t mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        uint8_t bl_len = csd[5] & 0x0F;
+        return ((c_size + 1) << (mult + 2 + bl_len)) / SD_BLK_SIZE;
+    }
+    return 0;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Read_Block(void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
+{
+    SDRESULTS res = SD_ERROR;
+    Transaction t;
+    if (Send_Cmd(t, CMD17, Addr(sector)) == 0) {
+        uint8_t tkn = Wait_Token();
+        if (tkn == 0xFE) {
+            crc16_ = 0;
+            // Skip offset, receive the wanted bytes and skip the remaining
+            Rx_Bytes(0, ofs);
+            Rx_Bytes((uint8_t *)dat, cnt);
+            Rx_Bytes(0, SD_BLK_SIZE - ofs - cnt);
+            res = Rx_End();
+        } else if (tkn == 0xFF) res = SD_NORESPONSE;
+    }
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Read_Multi(uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    SDRESULTS res = SD_ERROR;
+    *done = 0;
+    Transaction t;
+    if (Send_Cmd(t, CMD18, Addr(sector)) == 0) {
+        do {
+            res = Rx_Data(dat, SD_BLK_SIZE);
+            if (res != SD_OK) break;
+            dat += SD_BLK_SIZE;
+            (*done)++;
+        } while (--count);
+        // Stop transmission, the card can be busy a while after it
+        if (Send_Cmd(t, CMD12, 0) & 0x80) res = SD_ERROR;
+        if (!Wait_Ready(Config::write_timeout)) res = SD_BUSY;
+    }
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Write_Multi(const uint8_t *dat, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    SDRESULTS res = SD_ERROR;
+    *done = 0;
+    Transaction t;
+    // Let a SD card pre-erase the blocks that will be written
+    if (cardtype_ & SDCT_SDC) Send_Cmd(t, ACMD23, count);
+    if (Send_Cmd(t, CMD25, Addr(sector)) == 0) {
+        do {
+            res = Write_Block(dat, 0xFC);
+            if (res != SD_OK) break;
+            dat += SD_BLK_SIZE;
+            (*done)++;
+        } while (--count);
+        if ((Write_Block(0, 0xFD) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
+    }
+    return res;
+}
+
+template <class Spi, class Config>
+bool SdCard<Spi, Config>::Retry(SDRESULTS res, uint8_t trys)
+{
+    uint8_t r1;
+    if (res == SD_OK || trys == Config::retrys) return false;
+    // Stop transmission and read the status, like __SD_Recover
+    {
+        Transaction t;
+        Send_Cmd(t, CMD12, 0);
+    }
+    {
+        Transaction t;
+        r1 = Send_Cmd(t, CMD13, 0);
+        Spi::RW(0xFF);
+    }
+    if (!(r1 & 0x81)) return true;
+    if constexpr (Config::retry_reinit) return Init() == SD_OK;
+    return false;
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Init()
+{
+    uint8_t ct = 0, ocr[4], cmd = ACMD41;
+    if (xfer_) return SD_BUSY;
+    for (uint8_t trys = 0; (trys != Config::init_trys) && !ct; trys++) {
+        Spi::Init();
+        Spi::CS_High();
+        Spi::Freq_Low();
+        // 80 dummy clocks
+        for (uint8_t idx = 0; idx != 10; idx++) Spi::RW(0xFF);
+        Spi::Timer_On(Config::powerup_wait);
+        while (Spi::Timer_Status());
+        Spi::Timer_Off();
+        mount_ = false;
+        Transaction t;
+        Spi::Timer_On(Config::idle_timeout);
+        while ((Send_Cmd(t, CMD0, 0) != 1) && Spi::Timer_Status());
+        Spi::Timer_Off();
+        if (Send_Cmd(t, CMD0, 0) != 1) continue;
+        if (Send_Cmd(t, CMD8, 0x1AA) == 1) {
+            // SD version 2, VDD range of 2.7-3.6V is OK?
+            for (uint8_t n = 0; n < 4; n++) ocr[n] = Spi::RW(0xFF);
+            if ((ocr[2] == 0x01) && (ocr[3] == 0xAA)) {
+                Spi::Timer_On(Config::init_timeout);
+                while (Spi::Timer_Status() && Send_Cmd(t, ACMD41, 1UL << 30));
+                Spi::Timer_Off();
+                if (Spi::Timer_Status()) ct = Ocr(t, SDCT_SD2);
+            }
+        } else if constexpr (Config::sd1 || Config::mmc) {
+            if (Config::sd1 && (!Config::mmc || Send_Cmd(t, ACMD41, 0) <= 1)) {
+                ct = SDCT_SD1;
+                cmd = ACMD41;
+            } else {
+                ct = SDCT_MMC;
+                cmd = CMD1;
+            }
+            // Wait for leaving idle state, MMC offered the sector mode
+            Spi::Timer_On(Config::init_v1_timeout);
+            while (Spi::Timer_Status() && Send_Cmd(t, cmd, (cmd == CMD1) ? SD_MMC_OCR : 0));
+            Spi::Timer_Off();
+            if (!Spi::Timer_Status()) ct = 0;
+            else if (ct & SDCT_MMC) ct = Ocr(t, ct);
+            if (ct) {
+                if constexpr (!Config::crc) {
+                    if (Send_Cmd(t, CMD59, 0)) ct = 0;
+                }
+                if (ct && !(ct & SDCT_BLOCK) && Send_Cmd(t, CMD16, 512)) ct = 0;
+            }
+        }
+        if constexpr (Config::crc) {
+            if (ct && Send_Cmd(t, CMD59, 1)) ct = 0;
+        }
+    }
+    if (ct) {
+        cardtype_ = ct;
+        last_sector_ = Sectors() - 1;
+        // A card without a readable CSD is no use
+        if (last_sector_ == (uint32_t)-1) ct = 0;
+    }
+    if (ct) {
+        mount_ = true;
+        Spi::Freq_High();
+    }
+    return ct ? SD_OK : SD_NOINIT;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Read(void *dat, uint32_t sector, uint16_t ofs, uint16_t cnt)
+{
+    SDRESULTS res;
+    uint8_t trys = 0;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if ((sector > last_sector_) || (cnt == 0) || (ofs + cnt > SD_BLK_SIZE)) return SD_PARERR;
+    do {
+        res = Read_Block(dat, sector, ofs, cnt);
+    } while (Retry(res, trys++));
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Write(const void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    uint8_t trys = 0;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if (sector > last_sector_) return SD_PARERR;
+    do {
+        Transaction t;
+        res = SD_ERROR;
+        if (Send_Cmd(t, CMD24, Addr(sector)) == 0) res = Write_Block(dat, 0xFE);
+        t.End();
+    } while (Retry(res, trys++));
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Read_Blocks(void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint32_t done;
+    uint8_t trys = 0;
+    uint8_t *p = (uint8_t *)dat;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if ((count == 0) || (sector > last_sector_) || (count - 1 > last_sector_ - sector)) return SD_PARERR;
+    do {
+        res = Read_Multi(p, sector, count, &done);
+        // Go on from the first block not received
+        p += done * SD_BLK_SIZE;
+        sector += done;
+        count -= done;
+        if (done) trys = 0;
+    } while (count && Retry(res, trys++));
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Write_Blocks(const void *dat, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res;
+    uint32_t done;
+    uint8_t trys = 0;
+    const uint8_t *p = (const uint8_t *)dat;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if ((count == 0) || (sector > last_sector_) || (count - 1 > last_sector_ - sector)) return SD_PARERR;
+    do {
+        res = Write_Multi(p, sector, count, &done);
+        // Go on from the first block not accepted
+        p += done * SD_BLK_SIZE;
+        sector += done;
+        count -= done;
+        if (done) trys = 0;
+    } while (count && Retry(res, trys++));
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Erase(uint32_t first, uint32_t last)
+{
+    SDRESULTS res = SD_ERROR;
+    uint8_t cmd = CMD32;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if ((first > last) || (last > last_sector_)) return SD_PARERR;
+    // MMC uses its own erase group commands
+    if constexpr (Config::mmc) {
+        if (cardtype_ & SDCT_MMC) cmd = CMD35;
+    }
+    Transaction t;
+    if ((Send_Cmd(t, cmd, Addr(first)) == 0) && (Send_Cmd(t, cmd + 1, Addr(last)) == 0) && (Send_Cmd(t, CMD38, 0) == 0))
+        res = Wait_Ready(Config::erase_timeout) ? SD_OK : SD_BUSY;
+    return res;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Sync()
+{
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    Transaction t;
+    return Wait_Ready(Config::write_timeout) ? SD_OK : SD_BUSY;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Status()
+{
+    uint8_t r1;
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    // SEND_STATUS answers with R2: R1 and a second status byte
+    {
+        Transaction t;
+        r1 = Send_Cmd(t, CMD13, 0);
+        Spi::RW(0xFF);
+    }
+    if (r1 & 0x80) return SD_NORESPONSE;
+    return r1 ? SD_ERROR : SD_OK;
+}
+
+template <class Spi, class Config>
+SDRESULTS SdCard<Spi, Config>::Write_Open(Write_Session &s, uint32_t sector, uint32_t count)
+{
+    if (!mount_) return SD_NOINIT;
+    if (xfer_) return SD_BUSY;
+    if ((sector > last_sector_) || (count && (count - 1 > last_sector_ - sector))) return SD_PARERR;
+    s.Close();
+    Transaction t;
+    // Let a SD card pre-erase the blocks that will be written
+    if ((cardtype_ & SDCT_SDC) && count) Send_Cmd(t, ACMD23, count);
+    if (Send_Cmd(t, CMD25, Addr(sector))) return SD_ERROR;
+    // The session keeps the card selected until it is closed
+    s.t_ = static_cast<Transaction &&>(t);
+    s.card_ = this;
+    s.sector_ = sector;
+    xfer_ = true;
+    return SD_OK;
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * sd_journal.c: Log-structured record journal on raw SD sectors.
+ * See LICENSE.
+ */
+
+#include <string.h>
+
+#include "sd_journal.h"
+#include "sd_util.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Sector number of a sector of a segment.
+ */
+static inline uint32_t __SDJ_Sector(SD_JOURNAL *j, uint16_t seg, uint16_t blk)
+{
+    return j->first + (uint32_t)seg * j->seg_blocks + blk;
+}
+
+/**
+    \brief Check a sector header.
+    \param hdr Header bytes.
+    \param used Returns the bytes used of the data area.
+    \return Sequence number of the segment, 0 if it isn't a journal sector.
+ */
+static uint32_t __SDJ_Check(const uint8_t *hdr, uint16_t *used)
+{
+    *used = __SDU_Get16(hdr + 2);
+    if ((__SDU_Get16(hdr) != SDJ_MAGIC)||(*used > SDJ_DATA_SIZE)) return(0);
+    return(__SDU_Get32(hdr + 4));
+}
+
+/**
+    \brief Read the sequence number of a sector.
+    \param seq Returns the sequence number, 0 if it isn't a journal sector.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDJ_Seq(SD_JOURNAL *j, uint16_t seg, uint16_t blk, uint32_t *seq)
+{
+    SDRESULTS res;
+    uint8_t hdr[SDJ_HDR_SIZE];
+    uint16_t used;
+    res = SD_Read(j->dev, hdr, __SDJ_Sector(j, seg, blk), 0, SDJ_HDR_SIZE);
+    *seq = (res == SD_OK) ? __SDJ_Check(hdr, &used) : 0;
+    return(res);
+}
+
+/**
+    \brief Move the head to the start of the next segment.
+ */
+static void __SDJ_Next_Segment(SD_JOURNAL *j)
+{
+    j->seg = (j->seg + 1) % j->segments;
+    j->seq++;
+    j->blk = 0;
+}
+
+/**
+    \brief Write the sector buffer at the head.
+    \details The sector goes into the write session of the segment, which
+    is closed at the end of the segment.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDJ_Put_Block(SD_JOURNAL *j)
+{
+    SDRESULTS res;
+    uint32_t sector;
+    sector = __SDJ_Sector(j, j->seg, j->blk);
+    __SDU_Put16(j->buf, SDJ_MAGIC);
+    __SDU_Put16(j->buf + 2, j->used);
+    __SDU_Put32(j->buf + 4, j->seq);
+    memset(j->buf + SDJ_HDR_SIZE + j->used, 0, SDJ_DATA_SIZE - j->used);
+    res = __SDU_Put_Sector(j->dev, j->buf, sector, j->seg_blocks - j->blk);
+    if (res != SD_OK) return(res);
+    j->used = 0;
+    if (++j->blk == j->seg_blocks) {
+        res = SD_Write_Close(j->dev);
+        __SDJ_Next_Segment(j);
+    }
+    return(res);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Journal_Mount(SD_JOURNAL *j, SD_DEV *dev, uint32_t first, uint16_t segments, uint16_t seg_blocks)
+{
+    SDRESULTS res;
+    uint32_t seq0, seq;
+    uint16_t lo, hi, mid;
+    if ((segments < 2)||(seg_blocks == 0)) return(SD_PARERR);
+    if ((first > dev->last_sector)||((uint32_t)segments * seg_blocks - 1 > dev->last_sector - first)) return(SD_PARERR);
+    j->dev = dev;
+    j->first = first;
+    j->segments = segments;
+    j->seg_blocks = seg_blocks;
+    j->used = 0;
+    j->seg = 0;
+    j->blk = 0;
+#if SDJ_DEADLINE
+    j->deadline = 0;
+#endif
+    res = __SDJ_Seq(j, 0, 0, &seq0);
+    if (res != SD_OK) return(res);
+    // Empty journal
+    if (!seq0) {
+        j->seq = 1;
+        return(SD_OK);
+    }
+    // Segments of the last lap carry seq0, seq0 + 1, ... in order, so the
+    // head is the last segment k with sequence number seq0 + k
+    lo = 0;
+    hi = segments - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        res = __SDJ_Seq(j, mid, 0, &seq);
+        if (res != SD_OK) return(res);
+        if (seq == seq0 + mid) lo = mid;
+        else hi = mid - 1;
+    }
+    j->seg = lo;
+    j->seq = seq0 + lo;
+    // Same search for the first sector of the head not written in this lap
+    lo = 1;
+    hi = seg_blocks;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        res = __SDJ_Seq(j, j->seg, mid, &seq);
+        if (res != SD_OK) return(res);
+        if (seq == j->seq) lo = mid + 1;
+        else hi = mid;
+    }
+    j->blk = lo;
+    if (j->blk == seg_blocks) __SDJ_Next_Segment(j);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Journal_Append(SD_JOURNAL *j, const void *rec, uint16_t len)
+{
+    SDRESULTS res;
+    uint8_t *p;
+    if ((len == 0)||(len > SDJ_REC_MAX)) return(SD_PARERR);
+#if SDJ_DEADLINE
+    res = SD_Journal_Poll(j);
+    if (res != SD_OK) return(res);
+#endif
+    // No room left in this sector?
+    if (j->used + SDJ_REC_OVH + len > SDJ_DATA_SIZE) {
+        res = __SDJ_Put_Block(j);
+        if (res != SD_OK) return(res);
+    }
+#if SDJ_DEADLINE
+    if (!j->used) j->t_first = SPI_Millis();
+#endif
+    p = j->buf + SDJ_HDR_SIZE + j->used;
+    __SDU_Put16(p, len);
+    memcpy(p + 2, rec, len);
+#if SDJ_REC_CRC
+    __SDU_Put16(p + 2 + len, __SDU_Crc16(0, p + 2, len));
+#endif
+    j->used += SDJ_REC_OVH + len;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Journal_Sync(SD_JOURNAL *j)
+{
+    SDRESULTS res;
+    res = SD_OK;
+    if (j->used) res = __SDJ_Put_Block(j);
+    if (res == SD_OK) res = SD_Write_Close(j->dev);
+    return(res);
+}
+
+#if SDJ_DEADLINE
+void SD_Journal_Deadline(SD_JOURNAL *j, uint32_t ms)
+{
+    j->deadline = ms;
+    if (j->used) j->t_first = SPI_Millis();
+}
+
+SDRESULTS SD_Journal_Poll(SD_JOURNAL *j)
+{
+    if (!j->used || !j->deadline) return(SD_OK);
+    if (SPI_Millis() - j->t_first < j->deadline) return(SD_OK);
+    return(SD_Journal_Sync(j));
+}
+#endif
+
+SDRESULTS SD_Journal_First(SD_JOURNAL *j, SDJ_ITER *it)
+{
+    SDRESULTS res;
+    uint32_t seq;
+    uint16_t seg;
+    // After a wrap the oldest segment is the one that follows the head
+    seg = (j->seg + 1) % j->segments;
+    if (j->seq > j->segments) {
+        res = __SDJ_Seq(j, seg, 0, &seq);
+        if (res != SD_OK) return(res);
+        if (seq == j->seq - j->segments + 1) {
+            it->seg = seg;
+            it->seq = seq;
+            goto found;
+        }
+    }
+    it->seg = 0;
+    it->seq = j->seq - j->seg;
+found:
+    it->blk = 0;
+    it->pos = 0;
+    it->used = 0;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Journal_Next(SD_JOURNAL *j, SDJ_ITER *it, const uint8_t **rec, uint16_t *len)
+{
+    SDRESULTS res;
+    uint8_t *p;
+    uint16_t l;
+    for (;;) {
+        // Record left in the sector buffer?
+        if (it->pos + SDJ_REC_OVH <= it->used) {
+            p = it->buf + SDJ_HDR_SIZE + it->pos;
+            l = __SDU_Get16(p);
+            if ((l != 0)&&(it->pos + SDJ_REC_OVH + l <= it->used)) {
+                *rec = p + 2;
+                *len = l;
+                it->pos += SDJ_REC_OVH + l;
+#if SDJ_REC_CRC
+                if (__SDU_Get16(p + 2 + l) != __SDU_Crc16(0, p + 2, l)) return(SD_ERROR);
+#endif
+                return(SD_OK);
+            }
+        }
+        if (it->blk == j->seg_blocks) {
+            it->seg = (it->seg + 1) % j->segments;
+            it->seq++;
+            it->blk = 0;
+        }
+        // Reached the head?
+        if ((it->seg == j->seg)&&(it->blk == j->blk)) return(SD_PARERR);
+        res = SD_Read(j->dev, it->buf, __SDJ_Sector(j, it->seg, it->blk), 0, SD_BLK_SIZE);
+        if (res != SD_OK) return(res);
+        it->blk++;
+        it->pos = 0;
+        if (__SDJ_Check(it->buf, &it->used) != it->seq) return(SD_PARERR);
+    }
+}
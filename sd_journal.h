@@ -0,0 +1,149 @@
+/*
+ * sd_journal.h: Log-structured record journal on raw SD sectors.
+ * See LICENSE.
+ *
+ * The journal area is split in segments of consecutive sectors that are
+ * written in a ring. Every sector starts with a header that holds the
+ * sequence number of its segment; the header of the first sector is the
+ * segment header. Records are packed in the sectors as a 16-bit length and
+ * the record bytes (and their CRC16 with SDJ_REC_CRC), and never cross a
+ * sector. A sector is written when it is full, or with SDJ_DEADLINE when
+ * its oldest record has waited longer than the deadline of the journal.
+ */
+
+#ifndef _SD_JOURNAL_H_
+#define _SD_JOURNAL_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+/* CRC16 (CCITT) after each record, checked by SD_Journal_Next */
+#ifndef SDJ_REC_CRC
+#define SDJ_REC_CRC     0
+#endif
+
+/* Write deadline of the pending records (SD_Journal_Deadline, SPI_Millis) */
+#ifndef SDJ_DEADLINE
+#define SDJ_DEADLINE    0
+#endif
+
+#define SDJ_MAGIC       0x4A53                      /* Header mark      */
+#define SDJ_HDR_SIZE    8                           /* Sector header    */
+#define SDJ_DATA_SIZE   (SD_BLK_SIZE - SDJ_HDR_SIZE)
+#if SDJ_REC_CRC
+#define SDJ_REC_OVH     4                           /* Length and CRC   */
+#else
+#define SDJ_REC_OVH     2                           /* Length           */
+#endif
+#define SDJ_REC_MAX     (SDJ_DATA_SIZE - SDJ_REC_OVH) /* Longest record */
+
+/* Journal object */
+typedef struct _SD_JOURNAL {
+    SD_DEV *dev;
+    uint32_t first;         /* First sector of the journal area     */
+    uint16_t segments;      /* Number of segments                   */
+    uint16_t seg_blocks;    /* Sectors per segment                  */
+    uint32_t seq;           /* Sequence number of the head segment  */
+    uint16_t seg;           /* Head segment                         */
+    uint16_t blk;           /* Next sector to write in the segment  */
+    uint16_t used;          /* Bytes used of the data area of buf   */
+#if SDJ_DEADLINE
+    uint32_t deadline;      /* Longest wait of a record (ms)       */
+    uint32_t t_first;       /* SPI_Millis() of the oldest in buf   */
+#endif
+    uint8_t buf[SD_BLK_SIZE];
+} SD_JOURNAL;
+
+/* Record iterator */
+typedef struct _SDJ_ITER {
+    uint32_t seq;           /* Sequence number of the segment       */
+    uint16_t seg;           /* Segment                              */
+    uint16_t blk;           /* Sector in the segment                */
+    uint16_t pos;           /* Next record in the data area of buf  */
+    uint16_t used;          /* Bytes used of the data area of buf   */
+    uint8_t buf[SD_BLK_SIZE];
+} SDJ_ITER;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Mount a journal and find its head.
+    \details The head segment is found by a binary search over the segment
+    headers, so the mount reads O(log(segments) + seg_blocks) headers.
+    An area without a valid journal is taken as an empty journal.
+    \param j Journal object.
+    \param dev Initialized device descriptor.
+    \param first First sector of the journal area.
+    \param segments Number of segments (2..).
+    \param seg_blocks Sectors per segment (1..).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Journal_Mount(SD_JOURNAL *j, SD_DEV *dev, uint32_t first, uint16_t segments, uint16_t seg_blocks);
+
+/**
+    \brief Append a record.
+    \details Full sectors go out through one multiple block write session
+    per segment, which stays open between appends. Use SD_Journal_Sync
+    before using the card for anything else. With a deadline, the pending
+    records that are too old are written first.
+    \param j Journal object.
+    \param rec Record data.
+    \param len Record length (1..SDJ_REC_MAX).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Journal_Append(SD_JOURNAL *j, const void *rec, uint16_t len);
+
+/**
+    \brief Write the pending records and close the write session.
+    \details A partly filled sector is written as it is, the next records
+    start on the following sector.
+    \param j Journal object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Journal_Sync(SD_JOURNAL *j);
+
+#if SDJ_DEADLINE
+/**
+    \brief Set how long a record may wait in the sector buffer.
+    \details Once the oldest pending record is that old, the partly filled
+    sector is written like SD_Journal_Sync does, by the next
+    SD_Journal_Append or SD_Journal_Poll. Mount leaves it off.
+    \param j Journal object.
+    \param ms Deadline in milliseconds, 0 to write only full sectors.
+ */
+void SD_Journal_Deadline(SD_JOURNAL *j, uint32_t ms);
+
+/**
+    \brief Write the pending records if their deadline is over.
+    \details Call it periodically when records may stop arriving.
+    \param j Journal object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Journal_Poll(SD_JOURNAL *j);
+#endif
+
+/**
+    \brief Place an iterator on the oldest record of the journal.
+    \param j Journal object (synchronized).
+    \param it Iterator.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Journal_First(SD_JOURNAL *j, SDJ_ITER *it);
+
+/**
+    \brief Get the next record.
+    \details The record isn't copied, it stays valid until the next call.
+    \param j Journal object (synchronized).
+    \param it Iterator.
+    \param rec Returns a pointer to the record, inside the iterator buffer.
+    \param len Returns the record length.
+    \return SD_OK with a record, SD_PARERR at the end of the journal,
+    SD_ERROR for a record with a bad CRC (SDJ_REC_CRC), skipped by the next
+    call.
+ */
+SDRESULTS SD_Journal_Next(SD_JOURNAL *j, SDJ_ITER *it, const uint8_t **rec, uint16_t *len);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * sd_power.c: Power gated duty cycle mode, writes are batched in RAM.
+ * See LICENSE.
+ */
+
+#include <string.h>
+
+#include "sd_power.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Look for a sector in the staging area.
+    \return Index of the staged sector, n if it isn't staged.
+ */
+static uint16_t __SDP_Find(SD_POWER *p, uint32_t sector)
+{
+    uint16_t idx;
+    for (idx = 0; idx != p->staged; idx++)
+        if (p->sector[idx] == sector) return(idx);
+    return(p->n);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Power_Init(SD_POWER *p, SD_DEV *dev, uint8_t *buf, uint32_t *sector, uint16_t n)
+{
+    if ((!dev->mount)||(n == 0)) return(SD_PARERR);
+    p->dev = dev;
+    p->buf = buf;
+    p->sector = sector;
+    p->n = n;
+    p->staged = 0;
+    p->on_ms = 0;
+    p->written = 0;
+    p->cycles = 0;
+    // The card was powered by SD_Init
+    p->on = TRUE;
+    p->t_on = SPI_Millis();
+    return(SD_Power_Off(p));
+}
+
+SDRESULTS SD_Power_On(SD_POWER *p)
+{
+    SDRESULTS res;
+    if (p->on) return(SD_OK);
+    SDP_VDD_On();
+    p->on = TRUE;
+    p->t_on = SPI_Millis();
+    p->cycles++;
+    res = SD_Remount(p->dev);
+    if (res != SD_OK) SD_Power_Off(p);
+    return(res);
+}
+
+SDRESULTS SD_Power_Off(SD_POWER *p)
+{
+    SDRESULTS res;
+    if (!p->on) return(SD_OK);
+    // Programming must be over before the supply goes away
+    res = SD_OK;
+    if (p->dev->mount) {
+        SD_Write_Close(p->dev);
+        res = SD_Sync(p->dev);
+    }
+    p->dev->mount = FALSE;
+    SDP_VDD_Off();
+    p->on = FALSE;
+    p->on_ms += SPI_Millis() - p->t_on;
+    return(res);
+}
+
+SDRESULTS SD_Power_Write(SD_POWER *p, const void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    uint16_t idx;
+    if (sector > p->dev->last_sector) return(SD_PARERR);
+    idx = __SDP_Find(p, sector);
+    if (idx == p->n) {
+        if (p->staged == p->n) {
+            res = SD_Power_Flush(p);
+            if (res != SD_OK) return(res);
+        }
+        idx = p->staged++;
+        p->sector[idx] = sector;
+    }
+    memcpy(p->buf + (uint32_t)idx * SD_BLK_SIZE, dat, SD_BLK_SIZE);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Power_Read(SD_POWER *p, void *dat, uint32_t sector)
+{
+    SDRESULTS res;
+    uint16_t idx;
+    uint8_t was_on;
+    idx = __SDP_Find(p, sector);
+    if (idx != p->n) {
+        memcpy(dat, p->buf + (uint32_t)idx * SD_BLK_SIZE, SD_BLK_SIZE);
+        return(SD_OK);
+    }
+    was_on = p->on;
+    res = SD_Power_On(p);
+    if (res == SD_OK) res = SD_Read(p->dev, dat, sector, 0, SD_BLK_SIZE);
+    if (!was_on) SD_Power_Off(p);
+    return(res);
+}
+
+SDRESULTS SD_Power_Flush(SD_POWER *p)
+{
+    SDRESULTS res;
+    uint16_t idx, run;
+    if (!p->staged) return(SD_OK);
+    res = SD_Power_On(p);
+    if (res != SD_OK) return(res);
+    idx = 0;
+    while (idx != p->staged) {
+        // Run of consecutive sectors, they are also consecutive in buf
+        run = 1;
+        while ((idx + run != p->staged)&&(p->sector[idx + run] == p->sector[idx] + run)) run++;
+        res = SD_Write_Blocks(p->dev, p->buf + (uint32_t)idx * SD_BLK_SIZE, p->sector[idx], run);
+        if (res != SD_OK) break;
+        p->written += run;
+        idx += run;
+    }
+    // Keep what wasn't written for the next flush
+    if (idx) {
+        memmove(p->buf, p->buf + (uint32_t)idx * SD_BLK_SIZE, (uint32_t)(p->staged - idx) * SD_BLK_SIZE);
+        memmove(p->sector, p->sector + idx, (uint32_t)(p->staged - idx) * sizeof(uint32_t));
+        p->staged -= idx;
+    }
+    if ((SD_Power_Off(p) != SD_OK) && (res == SD_OK)) res = SD_BUSY;
+    return(res);
+}
+
+uint32_t SD_Power_Cost(SD_POWER *p)
+{
+    // Two sectors per KB
+    if (!p->written) return(0);
+    return((uint32_t)((uint64_t)p->on_ms * 2000 / p->written));
+}
@@ -0,0 +1,119 @@
+/*
+ * sd_power.h: Power gated duty cycle mode, writes are batched in RAM.
+ * See LICENSE.
+ *
+ * The card is kept without supply most of the time. Written sectors are
+ * staged in a RAM area; when it fills up (or on SD_Power_Flush) the card is
+ * powered, remounted through the SD_Remount fast path, the staged sectors
+ * are sent as multiple block writes and the card is powered down again once
+ * it has finished programming. The time the card spends powered is measured
+ * so the cost of the stored data can be followed (SD_Power_Cost).
+ */
+
+#ifndef _SD_POWER_H_
+#define _SD_POWER_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+/* Power gating object */
+typedef struct _SD_POWER {
+    SD_DEV *dev;
+    uint8_t *buf;           /* Staged sectors (n * 512 bytes)       */
+    uint32_t *sector;       /* Sector number of each staged sector  */
+    uint16_t n;             /* Sectors of the staging area          */
+    uint16_t staged;        /* Sectors staged                       */
+    uint8_t on;             /* Card powered                         */
+    uint32_t t_on;          /* SPI_Millis() at the last power up    */
+    uint32_t on_ms;         /* Time powered (ms)                    */
+    uint32_t written;       /* Sectors flushed to the card          */
+    uint16_t cycles;        /* Power cycles                         */
+} SD_POWER;
+
+/******************************************************************************
+ Port Methods - Provided by the platform, like the ones of spi_io.h
+******************************************************************************/
+
+/**
+    \brief Switch on the supply of the card and wait until it is stable.
+ */
+void SDP_VDD_On(void);
+
+/**
+    \brief Switch off the supply of the card.
+    \details The SPI lines and CS must be driven low as well, so the card
+    isn't powered through them.
+ */
+void SDP_VDD_Off(void);
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Set up the power gating of a card.
+    \details The card must have been initialized once with SD_Init, it is
+    then powered down here.
+    \param p Power gating object.
+    \param dev Initialized device descriptor.
+    \param buf Staging area of n * 512 bytes.
+    \param sector Room for n sector numbers.
+    \param n Sectors of the staging area (1..).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_Init(SD_POWER *p, SD_DEV *dev, uint8_t *buf, uint32_t *sector, uint16_t n);
+
+/**
+    \brief Power up and remount the card.
+    \param p Power gating object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_On(SD_POWER *p);
+
+/**
+    \brief Wait for the end of programming and power down the card.
+    \param p Power gating object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_Off(SD_POWER *p);
+
+/**
+    \brief Stage a sector for writing.
+    \details A sector already staged is replaced. A full staging area is
+    flushed first.
+    \param p Power gating object.
+    \param dat Data to write (512 bytes).
+    \param sector Sector number.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_Write(SD_POWER *p, const void *dat, uint32_t sector);
+
+/**
+    \brief Read a sector, from the staging area if it is there.
+    \details Otherwise the card is powered for the read, and powered down
+    afterwards if it was off.
+    \param p Power gating object.
+    \param dat Destination (512 bytes).
+    \param sector Sector number.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_Read(SD_POWER *p, void *dat, uint32_t sector);
+
+/**
+    \brief Write all the staged sectors within a single power cycle.
+    \details Runs of consecutive sectors staged in order go as one multiple
+    block write. If a write fails the sectors are kept staged.
+    \param p Power gating object.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Power_Flush(SD_POWER *p);
+
+/**
+    \brief Energy cost of the data written.
+    \param p Power gating object.
+    \return Card powered time per KB flushed, in microseconds.
+ */
+uint32_t SD_Power_Cost(SD_POWER *p);
+
+#endif
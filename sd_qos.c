@@ -0,0 +1,139 @@
+/*
+ * sd_qos.c: Per-client bandwidth budgets, requests scheduled by deficit
+ * round robin.
+ * See LICENSE.
+ */
+
+#include "sd_qos.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief Tell if a client has work it may do in this period.
+ */
+static uint8_t __SDQ_Ready(SDQ_CLIENT *c)
+{
+    if (!c->head) return(FALSE);
+    return(((c->budget == 0)||(c->used < c->budget)) ? TRUE : FALSE);
+}
+
+/**
+    \brief Pick the client to serve (deficit round robin).
+    \return Client, NULL if none can be served.
+ */
+static SDQ_CLIENT *__SDQ_Pick(SD_QOS *q)
+{
+    SDQ_CLIENT *c;
+    uint16_t k;
+    // Two laps: the client in turn may have its deficit spent
+    for (k = 0; k <= 2 * q->n; k++) {
+        c = &q->client[q->cur];
+        if (__SDQ_Ready(c)) {
+            if (!q->turn) {
+                c->deficit += c->quantum;
+                q->turn = TRUE;
+            }
+            if (c->deficit) return(c);
+        } else c->deficit = 0;
+        // Next client
+        if (++q->cur == q->n) q->cur = 0;
+        q->turn = FALSE;
+    }
+    return(0);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Qos_Init(SD_QOS *q, SD_DEV *dev, SDQ_CLIENT *client, uint8_t n, uint16_t chunk, uint16_t period)
+{
+    uint8_t idx;
+    if ((n == 0)||(chunk == 0)) return(SD_PARERR);
+    q->dev = dev;
+    q->client = client;
+    q->n = n;
+    q->cur = 0;
+    q->turn = FALSE;
+    q->chunk = chunk;
+    q->period = period;
+    q->t_period = SPI_Millis();
+    for (idx = 0; idx != n; idx++) {
+        client[idx].head = client[idx].tail = 0;
+        client[idx].quantum = chunk;
+        client[idx].budget = 0;
+        client[idx].used = 0;
+        client[idx].deficit = 0;
+        client[idx].sectors = 0;
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_Qos_Client(SD_QOS *q, uint8_t id, uint16_t quantum, uint32_t budget)
+{
+    if ((id >= q->n)||(quantum == 0)) return(SD_PARERR);
+    q->client[id].quantum = quantum;
+    q->client[id].budget = budget;
+    return(SD_OK);
+}
+
+SDRESULTS SD_Qos_Submit(SD_QOS *q, uint8_t id, SDQ_REQ *req)
+{
+    SDQ_CLIENT *c;
+    if ((id >= q->n)||(req->count == 0)||(req->op > SDQ_WRITE)) return(SD_PARERR);
+    req->next = 0;
+    req->done = FALSE;
+    req->res = SD_OK;
+    c = &q->client[id];
+    if (c->tail) c->tail->next = req;
+    else c->head = req;
+    c->tail = req;
+    return(SD_OK);
+}
+
+uint8_t SD_Qos_Run(SD_QOS *q)
+{
+    SDQ_CLIENT *c;
+    SDQ_REQ *req;
+    uint32_t now, k;
+    uint8_t idx;
+    SDRESULTS res;
+    // A new period gives every client its whole budget again
+    now = SPI_Millis();
+    if (now - q->t_period >= q->period) {
+        q->t_period = now;
+        for (idx = 0; idx != q->n; idx++) q->client[idx].used = 0;
+    }
+    c = __SDQ_Pick(q);
+    if (!c) return(FALSE);
+    // Chunk limited by the turn, the budget and the request
+    req = c->head;
+    k = q->chunk;
+    if (k > c->deficit) k = c->deficit;
+    if (c->budget && (k > c->budget - c->used)) k = c->budget - c->used;
+    if (k > req->count) k = req->count;
+    if (req->op == SDQ_WRITE) res = SD_Write_Blocks(q->dev, req->dat, req->sector, k);
+    else res = SD_Read_Blocks(q->dev, req->dat, req->sector, k);
+    // The card is taken (a write session is open): nothing moved, the
+    // request keeps its place and the client its share
+    if (res == SD_BUSY) return(FALSE);
+    // Only the sectors moved are charged
+    if (res == SD_OK) {
+        c->deficit -= k;
+        c->used += k;
+        c->sectors += k;
+        req->dat += k * SD_BLK_SIZE;
+        req->sector += k;
+        req->count -= k;
+    }
+    // Finished or failed: out of the queue
+    if ((res != SD_OK)||(req->count == 0)) {
+        c->head = req->next;
+        if (!c->head) c->tail = 0;
+        req->res = res;
+        req->done = TRUE;
+    }
+    return(TRUE);
+}
@@ -0,0 +1,102 @@
+/*
+ * sd_qos.h: Per-client bandwidth budgets, requests scheduled by deficit
+ * round robin.
+ * See LICENSE.
+ *
+ * Each client (logger, exporter, config store...) queues its transfers
+ * with SD_Qos_Submit and returns at once. SD_Qos_Run, called from a single
+ * task or the main loop, serves the queues in chunks of sectors: every
+ * turn a client may move up to its quantum, and no more than its budget
+ * over each period. A bulk reader can't starve a real-time writer, it waits
+ * at most one chunk of the other clients. The queues aren't locked:
+ * SD_Qos_Submit and SD_Qos_Run of different tasks need a mutex around them.
+ */
+
+#ifndef _SD_QOS_H_
+#define _SD_QOS_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+#define SDQ_READ        0
+#define SDQ_WRITE       1
+
+/* Transfer queued by a client */
+typedef struct _SDQ_REQ {
+    struct _SDQ_REQ *next;
+    uint8_t op;             /* SDQ_READ or SDQ_WRITE                */
+    uint8_t *dat;           /* Data of the next sector              */
+    uint32_t sector;        /* Next sector                          */
+    uint32_t count;         /* Sectors left                         */
+    volatile uint8_t done;  /* Set when finished (or failed)        */
+    volatile SDRESULTS res; /* Result, valid once done              */
+} SDQ_REQ;
+
+/* Client of the scheduler */
+typedef struct _SDQ_CLIENT {
+    SDQ_REQ *head, *tail;   /* Queued requests                      */
+    uint16_t quantum;       /* Sectors per round robin turn         */
+    uint32_t budget;        /* Sectors per period, 0 unlimited      */
+    uint32_t used;          /* Sectors moved in this period         */
+    uint32_t deficit;       /* Sectors left of the current turn     */
+    uint32_t sectors;       /* Sectors moved in total               */
+} SDQ_CLIENT;
+
+/* Scheduler object */
+typedef struct _SD_QOS {
+    SD_DEV *dev;
+    SDQ_CLIENT *client;     /* Client table                         */
+    uint8_t n;              /* Number of clients                    */
+    uint8_t cur;            /* Client in turn                       */
+    uint8_t turn;           /* Quantum of cur already granted       */
+    uint16_t chunk;         /* Longest single transfer (sectors)    */
+    uint16_t period;        /* Budget period (ms)                   */
+    uint32_t t_period;      /* SPI_Millis() at the period start     */
+} SD_QOS;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Set up a scheduler; every client starts with a quantum of one
+    chunk and no budget.
+    \param q Scheduler object.
+    \param dev Initialized device descriptor.
+    \param client Table of n clients.
+    \param n Number of clients (1..).
+    \param chunk Longest transfer done at once (sectors, 1..).
+    \param period Budget period (ms).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Qos_Init(SD_QOS *q, SD_DEV *dev, SDQ_CLIENT *client, uint8_t n, uint16_t chunk, uint16_t period);
+
+/**
+    \brief Set the share of a client.
+    \param id Client index.
+    \param quantum Sectors per turn (weight against the other clients, 1..).
+    \param budget Sectors per period, 0 for no limit.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Qos_Client(SD_QOS *q, uint8_t id, uint16_t quantum, uint32_t budget);
+
+/**
+    \brief Queue a transfer of a client, without waiting for it.
+    \details op, dat, sector and count of the request must be set; it must
+    stay untouched until done is set.
+    \param id Client index.
+    \param req Request.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Qos_Submit(SD_QOS *q, uint8_t id, SDQ_REQ *req);
+
+/**
+    \brief Serve one chunk of the client in turn.
+    \return TRUE if a transfer was done, FALSE if every queue is empty or
+    out of budget for this period, or the card is busy (SD_BUSY, the request
+    stays queued).
+ */
+uint8_t SD_Qos_Run(SD_QOS *q);
+
+#endif
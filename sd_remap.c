@@ -0,0 +1,132 @@
+/*
+ * sd_remap.c: Rotating slot pools for frequently rewritten sectors.
+ * See LICENSE.
+ */
+
+#include "sd_remap.h"
+#include "sd_util.h"
+
+/******************************************************************************
+ Private Methods
+******************************************************************************/
+
+/**
+    \brief CRC16 of the data area of a slot.
+    \param dat Slot buffer.
+    \return CRC value.
+ */
+static inline uint16_t __SDR_Crc(const uint8_t *dat)
+{
+    return(__SDU_Crc16(0xFFFF, dat + SDR_HDR_SIZE, SD_BLK_SIZE - SDR_HDR_SIZE));
+}
+
+/**
+    \brief Sector number of a slot.
+ */
+static inline uint32_t __SDR_Sector(SD_REMAP *rm, uint8_t lsn, uint16_t slot)
+{
+    return rm->first + (uint32_t)lsn * rm->slots + slot;
+}
+
+/**
+    \brief Read the version of a slot from its header.
+    \param ver Returns the version, 0 if the slot was never written.
+    \return If all goes well returns SD_OK.
+ */
+static SDRESULTS __SDR_Version(SD_REMAP *rm, uint8_t lsn, uint16_t slot, uint32_t *ver)
+{
+    SDRESULTS res;
+    uint8_t hdr[SDR_HDR_SIZE];
+    res = SD_Read(rm->dev, hdr, __SDR_Sector(rm, lsn, slot), 0, SDR_HDR_SIZE);
+    *ver = 0;
+    if ((res == SD_OK)&&(__SDU_Get16(hdr) == SDR_MAGIC)) *ver = __SDU_Get32(hdr + 4);
+    return(res);
+}
+
+/**
+    \brief Read a full slot and check it.
+    \param ver Expected version.
+    \param buf Destination (512 bytes).
+    \return SD_OK if the slot holds that version intact, SD_ERROR if not.
+ */
+static SDRESULTS __SDR_Load(SD_REMAP *rm, uint8_t lsn, uint16_t slot, uint32_t ver, uint8_t *buf)
+{
+    SDRESULTS res;
+    res = SD_Read(rm->dev, buf, __SDR_Sector(rm, lsn, slot), 0, SD_BLK_SIZE);
+    if (res != SD_OK) return(res);
+    if ((__SDU_Get16(buf) != SDR_MAGIC)||(__SDU_Get32(buf + 4) != ver)||(__SDU_Get16(buf + 2) != __SDR_Crc(buf)))
+        return(SD_ERROR);
+    return(SD_OK);
+}
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+SDRESULTS SD_Remap_Mount(SD_REMAP *rm, SD_DEV *dev, uint32_t first, uint8_t count, uint16_t slots, uint8_t *buf)
+{
+    SDRESULTS res;
+    uint32_t v0, ver;
+    uint16_t lo, hi, mid;
+    uint8_t lsn;
+    if ((count == 0)||(count > SDR_HOT_MAX)||(slots < 2)) return(SD_PARERR);
+    if ((first > dev->last_sector)||((uint32_t)count * slots - 1 > dev->last_sector - first)) return(SD_PARERR);
+    rm->dev = dev;
+    rm->first = first;
+    rm->count = count;
+    rm->slots = slots;
+    for (lsn = 0; lsn != count; lsn++) {
+        // Never written: the first write goes to slot 0
+        rm->slot[lsn] = slots - 1;
+        rm->version[lsn] = 0;
+        res = __SDR_Version(rm, lsn, 0, &v0);
+        if (res != SD_OK) return(res);
+        if (!v0) continue;
+        // Slots of the last lap carry v0, v0 + 1, ... in order
+        lo = 0;
+        hi = slots - 1;
+        while (lo < hi) {
+            mid = lo + (hi - lo + 1) / 2;
+            res = __SDR_Version(rm, lsn, mid, &ver);
+            if (res != SD_OK) return(res);
+            if (ver == v0 + mid) lo = mid;
+            else hi = mid - 1;
+        }
+        // A torn newest version falls back to the previous one
+        ver = v0 + lo;
+        if (__SDR_Load(rm, lsn, lo, ver, buf) != SD_OK) {
+            lo = lo ? lo - 1 : slots - 1;
+            ver--;
+            if ((ver == 0)||(__SDR_Load(rm, lsn, lo, ver, buf) != SD_OK)) continue;
+        }
+        rm->slot[lsn] = lo;
+        rm->version[lsn] = ver;
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_Remap_Read(SD_REMAP *rm, uint8_t lsn, uint8_t *dat)
+{
+    if ((lsn >= rm->count)||(rm->version[lsn] == 0)) return(SD_PARERR);
+    return(__SDR_Load(rm, lsn, rm->slot[lsn], rm->version[lsn], dat));
+}
+
+SDRESULTS SD_Remap_Write(SD_REMAP *rm, uint8_t lsn, uint8_t *dat)
+{
+    SDRESULTS res;
+    uint32_t ver;
+    uint16_t slot, crc;
+    if (lsn >= rm->count) return(SD_PARERR);
+    slot = (rm->slot[lsn] + 1) % rm->slots;
+    ver = rm->version[lsn] + 1;
+    crc = __SDR_Crc(dat);
+    __SDU_Put16(dat, SDR_MAGIC);
+    __SDU_Put16(dat + 2, crc);
+    __SDU_Put32(dat + 4, ver);
+    res = SD_Write(rm->dev, dat, __SDR_Sector(rm, lsn, slot));
+    if (res == SD_OK) {
+        rm->slot[lsn] = slot;
+        rm->version[lsn] = ver;
+    }
+    return(res);
+}
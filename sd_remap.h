@@ -0,0 +1,74 @@
+/*
+ * sd_remap.h: Rotating slot pools for frequently rewritten sectors.
+ * See LICENSE.
+ *
+ * Each logical "hot" sector (configuration, counters, superblock...) owns a
+ * pool of consecutive physical slots. Every rewrite goes to the next slot
+ * with a higher version number, so the same physical sector isn't written
+ * over and over. At mount the newest version of each sector is found by a
+ * binary search over its pool.
+ */
+
+#ifndef _SD_REMAP_H_
+#define _SD_REMAP_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+#ifndef SDR_HOT_MAX
+#define SDR_HOT_MAX     4                           /* Logical sectors      */
+#endif
+
+#define SDR_MAGIC       0x5253                      /* Slot mark            */
+#define SDR_HDR_SIZE    8                           /* Slot header          */
+#define SDR_DATA_SIZE   (SD_BLK_SIZE - SDR_HDR_SIZE)
+
+/* Remapping object */
+typedef struct _SD_REMAP {
+    SD_DEV *dev;
+    uint32_t first;                 /* First sector of the pools        */
+    uint16_t slots;                 /* Slots per logical sector         */
+    uint8_t count;                  /* Logical sectors                  */
+    uint16_t slot[SDR_HOT_MAX];     /* Slot of the newest version       */
+    uint32_t version[SDR_HOT_MAX];  /* Newest version, 0 if none        */
+} SD_REMAP;
+
+/******************************************************************************
+ Public Methods
+******************************************************************************/
+
+/**
+    \brief Mount the pools and find the newest version of each sector.
+    \details Pools take count * slots sectors from first. A newest version
+    with a bad checksum (torn write) is dropped for the previous one.
+    \param rm Remapping object.
+    \param dev Initialized device descriptor.
+    \param first First sector of the pools.
+    \param count Logical sectors (1..SDR_HOT_MAX).
+    \param slots Slots per logical sector (2..).
+    \param buf Work buffer of 512 bytes.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Remap_Mount(SD_REMAP *rm, SD_DEV *dev, uint32_t first, uint8_t count, uint16_t slots, uint8_t *buf);
+
+/**
+    \brief Read the newest version of a logical sector.
+    \param rm Remapping object.
+    \param lsn Logical sector.
+    \param dat Sector buffer (512 bytes); the data is at dat + SDR_HDR_SIZE.
+    \return If all goes well returns SD_OK, SD_PARERR if never written.
+ */
+SDRESULTS SD_Remap_Read(SD_REMAP *rm, uint8_t lsn, uint8_t *dat);
+
+/**
+    \brief Write a new version of a logical sector.
+    \param rm Remapping object.
+    \param lsn Logical sector.
+    \param dat Sector buffer (512 bytes) with the data at dat + SDR_HDR_SIZE;
+    the header bytes are filled in here.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Remap_Write(SD_REMAP *rm, uint8_t lsn, uint8_t *dat);
+
+#endif
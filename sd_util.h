@@ -0,0 +1,112 @@
+/*
+ * sd_util.h: Helpers shared by the driver and the modules that frame raw
+ * SD sectors (journal, delta streams, slot pools, time index).
+ * See LICENSE.
+ *
+ * Header fields on the card are little-endian. The CRC16 is the CCITT one
+ * (x^16 + x^12 + x^5 + 1, MSB first) of the SD data packets; each format
+ * keeps its own initial value.
+ */
+
+#ifndef _SD_UTIL_H_
+#define _SD_UTIL_H_
+
+#include <stdint.h>
+
+#include "sd_io.h"
+
+/**
+    \brief Get a little-endian 16-bit value.
+ */
+static inline uint16_t __SDU_Get16(const uint8_t *p)
+{
+    return ((uint16_t)p[1] << 8) | p[0];
+}
+
+/**
+    \brief Get a little-endian 32-bit value.
+ */
+static inline uint32_t __SDU_Get32(const uint8_t *p)
+{
+    return ((uint32_t)__SDU_Get16(p + 2) << 16) | __SDU_Get16(p);
+}
+
+/**
+    \brief Put a little-endian 16-bit value.
+ */
+static inline void __SDU_Put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+/**
+    \brief Put a little-endian 32-bit value.
+ */
+static inline void __SDU_Put32(uint8_t *p, uint32_t v)
+{
+    __SDU_Put16(p, (uint16_t)v);
+    __SDU_Put16(p + 2, (uint16_t)(v >> 16));
+}
+
+/**
+    \brief Add a byte to a CRC16 (CCITT).
+    \param crc CRC so far.
+    \param d Byte.
+    \return New CRC.
+ */
+static inline uint16_t __SDU_Crc16_Byte(uint16_t crc, uint8_t d)
+{
+    crc = (crc >> 8) | (crc << 8);
+    crc ^= d;
+    crc ^= (crc & 0xFF) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xFF) << 5;
+    return(crc);
+}
+
+/**
+    \brief CRC16 (CCITT) of a buffer.
+    \param crc Initial value (0 for the data packets and the journal
+    records, 0xFFFF for the slots of sd_remap).
+    \param p Data.
+    \param len Length in bytes.
+    \return CRC value.
+ */
+static inline uint16_t __SDU_Crc16(uint16_t crc, const uint8_t *p, uint16_t len)
+{
+    while (len--) crc = __SDU_Crc16_Byte(crc, *p++);
+    return(crc);
+}
+
+/**
+    \brief Write a sector of a sequential area.
+    \details The sector goes into the open write session, which is opened
+    if there is none. A session left at another sector (other area, other
+    writer on the same device) is closed first and a new one opened here.
+    If the session fails the sector is written again with SD_Write, that
+    has retries.
+    \param dev Device descriptor.
+    \param buf Sector data.
+    \param sector Sector number.
+    \param count Sectors left in the area from this one (pre-erase hint),
+    0 if unknown.
+    \return If all goes well returns SD_OK.
+ */
+static inline SDRESULTS __SDU_Put_Sector(SD_DEV *dev, uint8_t *buf, uint32_t sector, uint32_t count)
+{
+    SDRESULTS res = SD_OK;
+    if (dev->xfer && (dev->xfer_sector != sector)) {
+        res = SD_Write_Close(dev);
+        if (res != SD_OK) return(res);
+    }
+    if (!dev->xfer) res = SD_Write_Open(dev, sector, count);
+    if (res == SD_OK) res = SD_Write_Next(dev, buf);
+    if (res != SD_OK) {
+        SD_Write_Close(dev);
+        res = SD_Write(dev, buf, sector);
+    }
+    return(res);
+}
+
+#endif
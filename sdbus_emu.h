@@ -0,0 +1,54 @@
+/*
+ * sdbus_emu.h: Card images of the GNU/Linux port (sdbus_io.c.linux).
+ * See LICENSE.
+ *
+ * Images are sparse: only written sectors take memory, a sector never
+ * written reads as the erase pattern. A fork shares all the sectors of its
+ * image and copies a sector (and its table path) on the first write of
+ * either side, so it is also the way to take a snapshot. Capacity goes up
+ * to the 2 TiB of a 32-bit sector number.
+ */
+
+#ifndef _SDBUS_EMU_H_
+#define _SDBUS_EMU_H_
+
+#include <stdint.h>
+
+typedef struct _SDB_IMG SDB_IMG;
+
+/**
+    \brief Create an empty image.
+    \param sectors Capacity in sectors (multiple of 1024).
+    \param erase Byte returned by the sectors never written (0x00 or 0xFF).
+    \return The image, NULL without memory.
+ */
+SDB_IMG *SDB_Emu_New (uint32_t sectors, uint8_t erase);
+
+/**
+    \brief Copy on write copy of an image, in constant time.
+    \details Both images are independent afterwards. Keep the fork untouched
+    to have a snapshot, or go back to it with SDB_Emu_Insert.
+    \return The new image, NULL without memory.
+ */
+SDB_IMG *SDB_Emu_Fork (const SDB_IMG *img);
+
+/**
+    \brief Release an image; the sectors shared with forks are kept.
+ */
+void SDB_Emu_Free (SDB_IMG *img);
+
+/**
+    \brief Put an image in the card slot.
+    \details Takes effect in the next SDB_Init, the card goes on with the
+    image in use until then. Without any image inserted SDB_Init creates
+    one of SDB_EMU_SECTORS sectors.
+    \return The image that was in the slot.
+ */
+SDB_IMG *SDB_Emu_Insert (SDB_IMG *img);
+
+/**
+    \brief Sector blocks allocated by all the images.
+ */
+uint32_t SDB_Emu_Blocks (void);
+
+#endif
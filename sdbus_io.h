@@ -0,0 +1,61 @@
+/*
+ * sdbus_io.h: Low-level port of the native SD bus engine (sd_bus.c).
+ * See LICENSE.
+ */
+
+#ifndef _SDBUS_IO_H_
+#define _SDBUS_IO_H_
+
+#include <stdint.h>
+
+/* Lines of SDB_Clock */
+#define SDB_CMD     0x10    /* CMD line     */
+#define SDB_DAT     0x0F    /* DAT[3:0]     */
+#define SDB_DAT0    0x01    /* DAT0 (busy)  */
+
+/******************************************************************************
+ Public methods
+ *****************************************************************************/
+
+/**
+    \brief Initialize the bus hardware: CLK low, CMD and DAT released.
+ */
+void SDB_Init (void);
+
+/**
+    \brief Give one clock to the card.
+    \details Lines with a 1 in out are released (pulled up), lines with a 0
+    are driven low during the clock; they are sampled on the rising edge.
+    \param out Host levels, SDB_CMD and SDB_DAT bits.
+    \return Levels of the lines at the rising edge, same bits.
+ */
+uint8_t SDB_Clock (uint8_t out);
+
+/**
+    \brief Setting frequency of the clock to the maximum (25MHz or lower).
+ */
+void SDB_Freq_High (void);
+
+/**
+    \brief Setting frequency of the clock equal or lower than 400kHz.
+ */
+void SDB_Freq_Low (void);
+
+/**
+    \brief Start a non-blocking timer.
+    \param ms Milliseconds.
+ */
+void SDB_Timer_On (uint16_t ms);
+
+/**
+    \brief Check the status of non-blocking timer.
+    \return Status, TRUE if timeout is not reach yet.
+ */
+uint8_t SDB_Timer_Status (void);
+
+/**
+    \brief Stop of non-blocking timer. Mandatory.
+ */
+void SDB_Timer_Off (void);
+
+#endif
@@ -8,6 +8,8 @@
 #ifndef _SPI_IO_H_
 #define _SPI_IO_H_
 
+#include "sd_config.h"
+
 /******************************************************************************
  Public methods
  *****************************************************************************/
@@ -39,6 +41,14 @@ void SPI_CS_Low (void);
  */
 void SPI_CS_High (void);
 
+#if SD_IO_CARDS > 1
+/**
+    \brief Choose the CS line driven by SPI_CS_Low and SPI_CS_High.
+    \param cs Card select number (cs of SD_DEV).
+ */
+void SPI_CS_Sel (uint8_t cs);
+#endif
+
 /**
     \brief Setting frequency of SPI's clock to maximun possible.
  */
@@ -49,6 +59,15 @@ void SPI_Freq_High (void);
  */
 void SPI_Freq_Low (void);
 
+#if SD_IO_MMC && SD_IO_MMC_HS
+/**
+    \brief Setting frequency of SPI's clock up to the high speed timing of a
+    MMCv4 card, called after SPI_Freq_High.
+    \param mhz 26 or 52; the port may stay lower.
+ */
+void SPI_Freq_Card (uint8_t mhz);
+#endif
+
 /**
     \brief Start a non-blocking timer.
     \param ms Milliseconds.
@@ -66,6 +85,61 @@ uint8_t SPI_Timer_Status (void);
  */
 void SPI_Timer_Off (void);
 
+/**
+    \brief Free running millisecond counter (wraps around), time base of the
+    journal deadline, the power gating and the QoS periods.
+    \return Milliseconds.
+ */
+uint32_t SPI_Millis (void);
+
+#if SD_IO_BUSY_SENSE == 1
+/**
+    \brief Level of the DO (MISO) line, without clocking the bus.
+    \return TRUE if high (card not busy).
+ */
+uint8_t SPI_DO_Level (void);
+#elif SD_IO_BUSY_SENSE == 2
+/**
+    \brief Wait for the rising edge of the DO (MISO) line.
+    \details Arm a pin-change interrupt and sleep (or block on an RTOS
+    event) until DO is high or the time is over. Return at once if DO is
+    already high.
+    \param ms Timeout in milliseconds.
+ */
+void SPI_DO_Wait (uint16_t ms);
+#endif
+
+/* Driver phases seen by the timing probes */
+#define SD_PH_CMD       0   /* Command bytes                        */
+#define SD_PH_R1        1   /* Wait for the command response        */
+#define SD_PH_TOKEN     2   /* Data tokens: start token, response   */
+#define SD_PH_DATA      3   /* Payload of a data packet             */
+#define SD_PH_CRC       4   /* CRC16 of a data packet               */
+#define SD_PH_BUSY      5   /* Wait for the end of busy             */
+#define SD_PH_RELEASE   6   /* Release of the bus                   */
+
+#if SD_IO_PROBE
+/**
+    \brief Start of a driver phase (SD_PH_*).
+    \details Map it to a GPIO, a cycle counter timestamp or a trace buffer.
+    A port can also define SD_PROBE_BEGIN/SD_PROBE_END as macros instead.
+ */
+void SPI_Probe_Begin (uint8_t phase);
+
+/**
+    \brief End of a driver phase (SD_PH_*).
+ */
+void SPI_Probe_End (uint8_t phase);
+
+#ifndef SD_PROBE_BEGIN
+#define SD_PROBE_BEGIN(ph)  SPI_Probe_Begin(ph)
+#define SD_PROBE_END(ph)    SPI_Probe_End(ph)
+#endif
+#else
+#define SD_PROBE_BEGIN(ph)
+#define SD_PROBE_END(ph)
+#endif
+
 #endif
 
 /*